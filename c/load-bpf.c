@@ -115,6 +115,10 @@ int attachTracingEvent(int progFd, const char *event_path, int *pfd) {
   attr.config = strtol(buf, NULL, 0);
   attr.type = PERF_TYPE_TRACEPOINT;
   attr.sample_period = 1;
+  // This perf event is only used to attach the program, and nothing ever
+  // reads samples from it, so wakeup_events does not matter here. Batching
+  // wakeups is done on the perf buffers that carry the program's output
+  // (see openPerfBuffer() in opensnoop/opensnoop.c).
   attr.wakeup_events = 1;
   *pfd = syscall(__NR_perf_event_open, &attr, -1 /* pid */, 0 /* cpu */,
                  -1 /* group_fd */, PERF_FLAG_FD_CLOEXEC);
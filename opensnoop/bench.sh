@@ -0,0 +1,69 @@
+#!/bin/sh
+# Checks which open syscalls each --attach mode sees, and compares how much
+# each mode adds to every open(). Like opensnoop itself, this must be run with
+# sudo, after build.sh.
+set -e
+ITERATIONS=${1:-1000000}
+COVERAGE_ITERATIONS=1000
+clang open_bench.c -O2 -o open_bench
+
+# Start opensnoop with the given arguments in the background, with its output
+# going to $out, and set $pid, or return 1 if it exits.
+start_opensnoop() {
+  ./opensnoop "$@" > "$out" &
+  pid=$!
+  # Give opensnoop time to load and attach its programs.
+  sleep 2
+  kill -0 $pid 2>/dev/null
+}
+
+stop_opensnoop() {
+  kill $pid
+  wait $pid 2>/dev/null || true
+}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+out=$dir/out
+
+# Every syscall opens its own file so that its events can be told apart.
+for syscall in open openat openat2; do
+  touch "$dir/$syscall"
+done
+for mode in kprobe tracepoint fexit; do
+  if ! start_opensnoop --attach $mode -n open_bench --flush line; then
+    echo "--attach $mode: not supported by this kernel"
+    continue
+  fi
+  seen=""
+  for syscall in open openat openat2; do
+    # open does not exist on every architecture.
+    ./open_bench $COVERAGE_ITERATIONS "$dir/$syscall" $syscall \
+      > /dev/null 2>&1 || continue
+    sleep 1
+    count=$(grep -c " $dir/$syscall\$" "$out" || true)
+    seen="$seen $syscall $count/$COVERAGE_ITERATIONS"
+  done
+  stop_opensnoop
+  echo "--attach $mode sees:$seen"
+done
+
+out=/dev/null
+baseline=$(./open_bench "$ITERATIONS")
+echo "no tracing: $baseline ns per open"
+# --attach tracepoint attaches to every open syscall by default, so the last
+# one shows what the attach points that open_bench does not hit cost.
+for args in "--attach kprobe" "--attach tracepoint" "--attach fexit" \
+  "--attach tracepoint --attach-to openat" "--attach kprobe --entry-only" \
+  "--attach tracepoint --entry-only" \
+  "--attach tracepoint --entry-state hash" \
+  "--attach tracepoint --entry-state task" \
+  "--attach tracepoint --filter uid!=0"; do
+  if ! start_opensnoop $args; then
+    echo "$args: not supported by this kernel"
+    continue
+  fi
+  ns=$(./open_bench "$ITERATIONS")
+  stop_opensnoop
+  echo "$args: $ns ns per open ($((ns - baseline)) ns of overhead)"
+done
@@ -0,0 +1,353 @@
+/**
+ * A BPF assembler that runs at compile time. A program is written as a
+ * constexpr function that emits instructions with typed registers and labels,
+ * and is evaluated as a constant expression into a Program: an array of
+ * bpf_insn with every jump resolved. Values that are only known when the
+ * program is loaded, such as map fds and offsets into the context, are
+ * emitted as parameters, which Program::link() fills in from a struct of Args.
+ *
+ * Anything that cannot be assembled, such as a jump to a label that is never
+ * bound, calls assemblyError(), which is not constexpr, so it is a compile
+ * error rather than a broken program.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <linux/bpf.h>
+
+namespace bpf {
+
+// Never defined: see above.
+void assemblyError(const char *message);
+
+// A register. Taking these rather than integers keeps a register from being
+// passed where an immediate is expected, and the other way around.
+struct Reg {
+  uint8_t n;
+};
+
+inline constexpr Reg r0{0}, r1{1}, r2{2}, r3{3}, r4{4}, r5{5}, r6{6}, r7{7},
+    r8{8}, r9{9}, r10{10};
+
+// The size of a load or a store.
+enum class Size : uint8_t {
+  B = BPF_B,
+  H = BPF_H,
+  W = BPF_W,
+  DW = BPF_DW,
+};
+
+// A value that Program::link() takes from a member of Args.
+template <typename Args> struct Param {
+  int Args::*member;
+};
+
+// The imm or off of an instruction: either a constant or a Param.
+template <typename Args> struct Operand {
+  constexpr Operand(int32_t value) : value(value), param(nullptr) {}
+  constexpr Operand(Param<Args> param) : value(0), param(param.member) {}
+
+  int32_t value;
+  int Args::*param;
+};
+
+// A position in the program that jumps can target before it is bound.
+struct Label {
+  size_t id;
+};
+
+// Which field of an instruction a Param goes in.
+enum class Field : uint8_t {
+  Imm,
+  Off,
+};
+
+// Where Program::link() writes a Param.
+template <typename Args> struct Relocation {
+  size_t insn = 0;
+  Field field = Field::Imm;
+  int Args::*param = nullptr;
+};
+
+/**
+ * An assembled program of N instructions with R parameters, which is what
+ * Assembler::program() returns.
+ */
+template <typename Args, size_t N, size_t R> struct Program {
+  /**
+   * Copies the program into insns, which must have room for N instructions,
+   * with its parameters taken from args. Returns N, or -1 if a parameter does
+   * not fit in its field.
+   */
+  int link(const Args &args, struct bpf_insn insns[]) const {
+    for (size_t i = 0; i < N; i++) {
+      insns[i] = this->insns[i];
+    }
+    for (size_t i = 0; i < R; i++) {
+      const Relocation<Args> &relocation = relocations[i];
+      int value = args.*relocation.param;
+      if (relocation.field == Field::Imm) {
+        insns[relocation.insn].imm = value;
+      } else if (value >= INT16_MIN && value <= INT16_MAX) {
+        insns[relocation.insn].off = value;
+      } else {
+        return -1;
+      }
+    }
+    return N;
+  }
+
+  struct bpf_insn insns[N] = {};
+  // Zero-length arrays are not allowed.
+  Relocation<Args> relocations[R == 0 ? 1 : R] = {};
+};
+
+/**
+ * Emits up to Capacity instructions, which program() then turns into a
+ * Program of exactly the right size:
+ *
+ *   constexpr auto assembler = [] {
+ *     Assembler<Args> a;
+ *     ...
+ *     return a;
+ *   }();
+ *   constexpr auto program =
+ *       assembler.program<assembler.size(), assembler.numParams()>();
+ *
+ * Every emitting method is named after the instruction it emits, and takes
+ * its operands in the order that BPF assembly writes them in.
+ */
+template <typename Args, size_t Capacity = 256> class Assembler {
+public:
+  constexpr Label newLabel() {
+    if (numLabels == MAX_LABELS) {
+      assemblyError("too many labels");
+    }
+    labels[numLabels] = UNBOUND;
+    return Label{numLabels++};
+  }
+
+  // Makes label refer to the next instruction.
+  constexpr void bind(Label label) {
+    if (labels[label.id] != UNBOUND) {
+      assemblyError("label bound twice");
+    }
+    labels[label.id] = count;
+  }
+
+  // dst = src, and likewise for the other ALU operations, all 64-bit.
+  constexpr void mov(Reg dst, Reg src) { alu(BPF_MOV, dst, src); }
+  constexpr void mov(Reg dst, Operand<Args> imm) { alu(BPF_MOV, dst, imm); }
+  constexpr void add(Reg dst, Reg src) { alu(BPF_ADD, dst, src); }
+  constexpr void add(Reg dst, Operand<Args> imm) { alu(BPF_ADD, dst, imm); }
+  constexpr void sub(Reg dst, Reg src) { alu(BPF_SUB, dst, src); }
+  constexpr void sub(Reg dst, Operand<Args> imm) { alu(BPF_SUB, dst, imm); }
+  constexpr void mul(Reg dst, Reg src) { alu(BPF_MUL, dst, src); }
+  constexpr void mul(Reg dst, Operand<Args> imm) { alu(BPF_MUL, dst, imm); }
+  constexpr void div(Reg dst, Reg src) { alu(BPF_DIV, dst, src); }
+  constexpr void div(Reg dst, Operand<Args> imm) { alu(BPF_DIV, dst, imm); }
+  constexpr void mod(Reg dst, Reg src) { alu(BPF_MOD, dst, src); }
+  constexpr void mod(Reg dst, Operand<Args> imm) { alu(BPF_MOD, dst, imm); }
+  constexpr void bitOr(Reg dst, Reg src) { alu(BPF_OR, dst, src); }
+  constexpr void bitOr(Reg dst, Operand<Args> imm) { alu(BPF_OR, dst, imm); }
+  constexpr void bitAnd(Reg dst, Reg src) { alu(BPF_AND, dst, src); }
+  constexpr void bitAnd(Reg dst, Operand<Args> imm) { alu(BPF_AND, dst, imm); }
+  constexpr void bitXor(Reg dst, Reg src) { alu(BPF_XOR, dst, src); }
+  constexpr void bitXor(Reg dst, Operand<Args> imm) { alu(BPF_XOR, dst, imm); }
+  constexpr void lsh(Reg dst, Operand<Args> imm) { alu(BPF_LSH, dst, imm); }
+  constexpr void rsh(Reg dst, Operand<Args> imm) { alu(BPF_RSH, dst, imm); }
+  constexpr void arsh(Reg dst, Operand<Args> imm) { alu(BPF_ARSH, dst, imm); }
+
+  // dst = value, which takes two instructions.
+  constexpr void load64(Reg dst, uint64_t value) {
+    emit(BPF_LD | BPF_DW | BPF_IMM, dst.n, 0, 0, (int32_t)(uint32_t)value);
+    emit(0, 0, 0, 0, (int32_t)(uint32_t)(value >> 32));
+  }
+
+  // dst = the map whose fd is map, which takes two instructions.
+  constexpr void loadMap(Reg dst, Param<Args> map) {
+    relocate(Field::Imm, map.member);
+    emit(BPF_LD | BPF_DW | BPF_IMM, dst.n, BPF_PSEUDO_MAP_FD, 0, 0);
+    emit(0, 0, 0, 0, 0);
+  }
+
+  // dst = *(size *)(src + off)
+  constexpr void load(Size size, Reg dst, Reg src, Operand<Args> off) {
+    relocate(Field::Off, off.param);
+    emit(BPF_LDX | (uint8_t)size | BPF_MEM, dst.n, src.n, off.value, 0);
+  }
+
+  // *(size *)(dst + off) = src
+  constexpr void store(Size size, Reg dst, int16_t off, Reg src) {
+    emit(BPF_STX | (uint8_t)size | BPF_MEM, dst.n, src.n, off, 0);
+  }
+
+  // lock *(size *)(dst + off) += src
+  constexpr void atomicAdd(Size size, Reg dst, int16_t off, Reg src) {
+    emit(BPF_STX | (uint8_t)size | BPF_ATOMIC, dst.n, src.n, off, BPF_ADD);
+  }
+
+  // if dst == src goto target, and likewise for the other comparisons.
+  constexpr void jeq(Reg dst, Reg src, Label target) {
+    jump(BPF_JEQ, dst, src, target);
+  }
+  constexpr void jeq(Reg dst, Operand<Args> imm, Label target) {
+    jump(BPF_JEQ, dst, imm, target);
+  }
+  constexpr void jne(Reg dst, Reg src, Label target) {
+    jump(BPF_JNE, dst, src, target);
+  }
+  constexpr void jne(Reg dst, Operand<Args> imm, Label target) {
+    jump(BPF_JNE, dst, imm, target);
+  }
+  constexpr void jge(Reg dst, Reg src, Label target) {
+    jump(BPF_JGE, dst, src, target);
+  }
+  constexpr void jge(Reg dst, Operand<Args> imm, Label target) {
+    jump(BPF_JGE, dst, imm, target);
+  }
+  constexpr void jlt(Reg dst, Reg src, Label target) {
+    jump(BPF_JLT, dst, src, target);
+  }
+  constexpr void jlt(Reg dst, Operand<Args> imm, Label target) {
+    jump(BPF_JLT, dst, imm, target);
+  }
+  constexpr void jle(Reg dst, Reg src, Label target) {
+    jump(BPF_JLE, dst, src, target);
+  }
+  constexpr void jle(Reg dst, Operand<Args> imm, Label target) {
+    jump(BPF_JLE, dst, imm, target);
+  }
+  constexpr void jsgt(Reg dst, Reg src, Label target) {
+    jump(BPF_JSGT, dst, src, target);
+  }
+  constexpr void jsgt(Reg dst, Operand<Args> imm, Label target) {
+    jump(BPF_JSGT, dst, imm, target);
+  }
+
+  // goto target
+  constexpr void ja(Label target) {
+    fixup(target);
+    emit(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+  }
+
+  constexpr void call(enum bpf_func_id helper) {
+    emit(BPF_JMP | BPF_CALL, 0, 0, 0, helper);
+  }
+
+  constexpr void exit() { emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0); }
+
+  constexpr size_t size() const { return count; }
+
+  constexpr size_t numParams() const { return numRelocations; }
+
+  /**
+   * Returns the program with its jumps resolved. N and R must be size() and
+   * numParams(), which is what lets the Program be exactly that size.
+   */
+  template <size_t N, size_t R> constexpr Program<Args, N, R> program() const {
+    if (N != count || R != numRelocations) {
+      assemblyError("program() must be given size() and numParams()");
+    }
+    Program<Args, N, R> program;
+    for (size_t i = 0; i < N; i++) {
+      program.insns[i] = insns[i];
+    }
+    for (size_t i = 0; i < R; i++) {
+      program.relocations[i] = relocations[i];
+    }
+    for (size_t i = 0; i < numFixups; i++) {
+      const Fixup &fixup = fixups[i];
+      if (labels[fixup.label] == UNBOUND) {
+        assemblyError("jump to a label that is never bound");
+      }
+      // Jumps are relative to the next instruction.
+      long off = (long)labels[fixup.label] - (long)fixup.insn - 1;
+      if (off < INT16_MIN || off > INT16_MAX) {
+        assemblyError("jump out of range");
+      }
+      program.insns[fixup.insn].off = off;
+    }
+    return program;
+  }
+
+private:
+  static constexpr size_t MAX_LABELS = 16;
+  static constexpr size_t MAX_FIXUPS = 64;
+  static constexpr size_t MAX_RELOCATIONS = 32;
+  static constexpr size_t UNBOUND = SIZE_MAX;
+
+  // A jump whose off is the distance to a label.
+  struct Fixup {
+    size_t insn = 0;
+    size_t label = 0;
+  };
+
+  constexpr void alu(uint8_t op, Reg dst, Reg src) {
+    emit(BPF_ALU64 | op | BPF_X, dst.n, src.n, 0, 0);
+  }
+
+  constexpr void alu(uint8_t op, Reg dst, Operand<Args> imm) {
+    relocate(Field::Imm, imm.param);
+    emit(BPF_ALU64 | op | BPF_K, dst.n, 0, 0, imm.value);
+  }
+
+  constexpr void jump(uint8_t op, Reg dst, Reg src, Label target) {
+    fixup(target);
+    emit(BPF_JMP | op | BPF_X, dst.n, src.n, 0, 0);
+  }
+
+  constexpr void jump(uint8_t op, Reg dst, Operand<Args> imm, Label target) {
+    fixup(target);
+    relocate(Field::Imm, imm.param);
+    emit(BPF_JMP | op | BPF_K, dst.n, 0, 0, imm.value);
+  }
+
+  // Records that the next instruction jumps to target.
+  constexpr void fixup(Label target) {
+    if (numFixups == MAX_FIXUPS) {
+      assemblyError("too many jumps");
+    }
+    fixups[numFixups].insn = count;
+    fixups[numFixups].label = target.id;
+    numFixups++;
+  }
+
+  // Records that param goes in field of the next instruction, if it is one.
+  constexpr void relocate(Field field, int Args::*param) {
+    if (param == nullptr) {
+      return;
+    }
+    if (numRelocations == MAX_RELOCATIONS) {
+      assemblyError("too many parameters");
+    }
+    relocations[numRelocations].insn = count;
+    relocations[numRelocations].field = field;
+    relocations[numRelocations].param = param;
+    numRelocations++;
+  }
+
+  constexpr void emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off,
+                      int32_t imm) {
+    if (count == Capacity) {
+      assemblyError("program is longer than the Assembler's Capacity");
+    }
+    struct bpf_insn &insn = insns[count++];
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+  }
+
+  struct bpf_insn insns[Capacity] = {};
+  size_t count = 0;
+  size_t labels[MAX_LABELS] = {};
+  size_t numLabels = 0;
+  Fixup fixups[MAX_FIXUPS] = {};
+  size_t numFixups = 0;
+  Relocation<Args> relocations[MAX_RELOCATIONS] = {};
+  size_t numRelocations = 0;
+};
+
+} // namespace bpf
@@ -0,0 +1,240 @@
+#include "btf.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// linux/btf.h documents these encodings but leaves the macros to libbpf.
+#define BTF_INFO_ENC(kind, kindFlag, vlen)                                     \
+  ((!!(kindFlag) << 31) | ((kind) << 24) | (vlen))
+#define BTF_INT_ENC(encoding, offset, bits)                                    \
+  (((encoding) << 24) | ((offset) << 16) | (bits))
+
+/**
+ * Reads all of path into a buffer that the caller must free. Returns NULL with
+ * errno set on failure.
+ */
+static char *readFile(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  char *buf = NULL;
+  int savedErrno;
+  // Unlike most sysfs files, /sys/kernel/btf/vmlinux reports its real size.
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    goto error;
+  }
+  buf = malloc(st.st_size);
+  if (buf == NULL) {
+    goto error;
+  }
+  size_t len = 0;
+  while (len < (size_t)st.st_size) {
+    ssize_t rc = read(fd, buf + len, st.st_size - len);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      goto error;
+    }
+    if (rc == 0) {
+      break;
+    }
+    len += rc;
+  }
+  close(fd);
+  *size = len;
+  return buf;
+
+error:
+  savedErrno = errno;
+  free(buf);
+  close(fd);
+  errno = savedErrno;
+  return NULL;
+}
+
+/**
+ * Returns the number of bytes that follow a btf_type of the given kind, or -1
+ * for a kind this parser does not know, which it cannot skip over.
+ */
+static long extraSize(const struct btf_type *type) {
+  __u32 vlen = BTF_INFO_VLEN(type->info);
+  switch (BTF_INFO_KIND(type->info)) {
+  case BTF_KIND_PTR:
+  case BTF_KIND_FWD:
+  case BTF_KIND_TYPEDEF:
+  case BTF_KIND_VOLATILE:
+  case BTF_KIND_CONST:
+  case BTF_KIND_RESTRICT:
+  case BTF_KIND_FUNC:
+  case BTF_KIND_FLOAT:
+  case BTF_KIND_TYPE_TAG:
+    return 0;
+  case BTF_KIND_INT:
+    return sizeof(__u32);
+  case BTF_KIND_ARRAY:
+    return sizeof(struct btf_array);
+  case BTF_KIND_STRUCT:
+  case BTF_KIND_UNION:
+    return vlen * sizeof(struct btf_member);
+  case BTF_KIND_ENUM:
+    return vlen * sizeof(struct btf_enum);
+  case BTF_KIND_FUNC_PROTO:
+    return vlen * sizeof(struct btf_param);
+  case BTF_KIND_VAR:
+    return sizeof(struct btf_var);
+  case BTF_KIND_DATASEC:
+    return vlen * sizeof(struct btf_var_secinfo);
+  case BTF_KIND_DECL_TAG:
+    return sizeof(struct btf_decl_tag);
+  case BTF_KIND_ENUM64:
+    return vlen * sizeof(struct btf_enum64);
+  default:
+    return -1;
+  }
+}
+
+int btfFindKernelFunction(const char *name, int *numArgs) {
+  size_t size;
+  char *data = readFile(BTF_VMLINUX_PATH, &size);
+  if (data == NULL) {
+    return -1;
+  }
+
+  const struct btf_header *header = (const struct btf_header *)data;
+  if (size < sizeof(*header) || header->magic != BTF_MAGIC ||
+      header->hdr_len + header->type_off + header->type_len > size ||
+      header->hdr_len + header->str_off + header->str_len > size) {
+    free(data);
+    errno = EINVAL;
+    return -1;
+  }
+  int savedErrno;
+  const char *types = data + header->hdr_len + header->type_off;
+  const char *strings = data + header->hdr_len + header->str_off;
+
+  // Type IDs are implicit: the first type in the section is 1. The offsets of
+  // all the types are kept so that a FUNC can be followed to its FUNC_PROTO,
+  // which may come before or after it.
+  size_t numTypes = 0, capacity = 0;
+  const struct btf_type **byId = NULL;
+  int funcId = -1;
+  size_t offset = 0;
+  while (offset + sizeof(struct btf_type) <= header->type_len) {
+    const struct btf_type *type = (const struct btf_type *)(types + offset);
+    long extra = extraSize(type);
+    if (extra < 0) {
+      errno = EINVAL;
+      goto error;
+    }
+    if (numTypes + 1 >= capacity) {
+      capacity = capacity == 0 ? 1024 : capacity * 2;
+      const struct btf_type **grown = realloc(byId, capacity * sizeof(*byId));
+      if (grown == NULL) {
+        goto error;
+      }
+      byId = grown;
+    }
+    byId[++numTypes] = type;
+    if (BTF_INFO_KIND(type->info) == BTF_KIND_FUNC &&
+        type->name_off < header->str_len &&
+        strcmp(strings + type->name_off, name) == 0) {
+      funcId = numTypes;
+    }
+    offset += sizeof(struct btf_type) + extra;
+  }
+
+  if (funcId == -1) {
+    errno = ENOENT;
+    goto error;
+  }
+  __u32 protoId = byId[funcId]->type;
+  if (protoId == 0 || protoId > numTypes ||
+      BTF_INFO_KIND(byId[protoId]->info) != BTF_KIND_FUNC_PROTO) {
+    errno = EINVAL;
+    goto error;
+  }
+  *numArgs = BTF_INFO_VLEN(byId[protoId]->info);
+
+  free(byId);
+  free(data);
+  return funcId;
+
+error:
+  savedErrno = errno;
+  free(byId);
+  free(data);
+  errno = savedErrno;
+  return -1;
+}
+
+int btfLoadMapTypes(__u32 valueSize, __u32 *keyTypeId, __u32 *valueTypeId) {
+  // The value is described as struct value { char data[valueSize]; }, which is
+  // enough for maps that do not look inside it.
+  static const char strings[] = "\0int\0char\0value\0data";
+  enum { INT_NAME = 1, CHAR_NAME = 5, VALUE_NAME = 10, DATA_NAME = 16 };
+  enum { INT_ID = 1, CHAR_ID, ARRAY_ID, VALUE_ID };
+  struct map_btf {
+    struct btf_header header;
+    struct btf_type intType;
+    __u32 intEncoding;
+    struct btf_type charType;
+    __u32 charEncoding;
+    struct btf_type arrayType;
+    struct btf_array array;
+    struct btf_type valueType;
+    struct btf_member member;
+    char strings[sizeof(strings)];
+  } btf;
+  memset(&btf, 0, sizeof(btf));
+
+  btf.intType.name_off = INT_NAME;
+  btf.intType.info = BTF_INFO_ENC(BTF_KIND_INT, 0, 0);
+  btf.intType.size = sizeof(int);
+  btf.intEncoding = BTF_INT_ENC(BTF_INT_SIGNED, 0, 32);
+  btf.charType.name_off = CHAR_NAME;
+  btf.charType.info = BTF_INFO_ENC(BTF_KIND_INT, 0, 0);
+  btf.charType.size = sizeof(char);
+  btf.charEncoding = BTF_INT_ENC(BTF_INT_SIGNED, 0, 8);
+  btf.arrayType.info = BTF_INFO_ENC(BTF_KIND_ARRAY, 0, 0);
+  btf.array.type = CHAR_ID;
+  btf.array.index_type = INT_ID;
+  btf.array.nelems = valueSize;
+  btf.valueType.name_off = VALUE_NAME;
+  btf.valueType.info = BTF_INFO_ENC(BTF_KIND_STRUCT, 0, 1);
+  btf.valueType.size = valueSize;
+  btf.member.name_off = DATA_NAME;
+  btf.member.type = ARRAY_ID;
+  memcpy(btf.strings, strings, sizeof(strings));
+
+  btf.header.magic = BTF_MAGIC;
+  btf.header.version = BTF_VERSION;
+  btf.header.hdr_len = sizeof(btf.header);
+  btf.header.type_off = 0;
+  btf.header.type_len = offsetof(struct map_btf, strings) - sizeof(btf.header);
+  btf.header.str_off = btf.header.type_len;
+  btf.header.str_len = sizeof(strings);
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.btf = (__u64)(unsigned long)&btf;
+  // Not sizeof(btf), which may have padding after the strings that the
+  // kernel would reject.
+  attr.btf_size = offsetof(struct map_btf, strings) + sizeof(strings);
+  int fd = syscall(__NR_bpf, BPF_BTF_LOAD, &attr, sizeof(attr));
+  if (fd < 0) {
+    return -1;
+  }
+  *keyTypeId = INT_ID;
+  *valueTypeId = VALUE_ID;
+  return fd;
+}
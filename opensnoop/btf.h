@@ -0,0 +1,25 @@
+/**
+ * Just enough of a BTF parser to find a kernel function in the BTF that the
+ * kernel exposes about itself, which is what an fexit program is attached by,
+ * and just enough of a BTF writer to describe the maps that need it.
+ */
+#pragma once
+#include <linux/types.h>
+
+// Where the kernel exposes its BTF, if it was built with CONFIG_DEBUG_INFO_BTF.
+#define BTF_VMLINUX_PATH "/sys/kernel/btf/vmlinux"
+
+/**
+ * Looks up the function called name in the kernel BTF. Returns its BTF type ID
+ * and sets *numArgs to its number of arguments, or returns -1 with errno set:
+ * ENOENT if the kernel has no BTF or no such function.
+ */
+int btfFindKernelFunction(const char *name, int *numArgs);
+
+/**
+ * Loads BTF that describes a map with an int key and a value of valueSize
+ * bytes, which the kernel only needs the size of. Returns the BTF fd and sets
+ * the type IDs to pass along with it to BPF_MAP_CREATE, or returns -1 with
+ * errno set.
+ */
+int btfLoadMapTypes(__u32 valueSize, __u32 *keyTypeId, __u32 *valueTypeId);
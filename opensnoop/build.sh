@@ -1,5 +1,6 @@
 #!/bin/sh
 # Note the generated opensnoop executable must be run with sudo.
 set -e
-python opensnoop.py
-clang opensnoop.c -O3 -o opensnoop /usr/lib/x86_64-linux-gnu/libbpf.so
+# The BPF programs are assembled while programs.cc compiles.
+clang++ -std=c++17 -O3 -fno-exceptions -fno-rtti -c programs.cc -o programs.o
+clang opensnoop.c btf.c capture.c filter.c output.c programs.o -O3 -o opensnoop /usr/lib/x86_64-linux-gnu/libbpf.so -lpthread
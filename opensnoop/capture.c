@@ -0,0 +1,416 @@
+#include "capture.h"
+#include "opensnoop.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Writes all of buf at the current offset of fd, retrying partial writes.
+ */
+static int writeAll(int fd, const void *buf, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    ssize_t rc = write(fd, (const char *)buf + written, len - written);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    written += rc;
+  }
+  return 0;
+}
+
+/**
+ * Reads exactly len bytes at offset, failing with EIO on a short read.
+ */
+static int preadAll(int fd, void *buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t rc = pread(fd, (char *)buf + done, len - done, offset + done);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (rc == 0) {
+      errno = EIO;
+      return -1;
+    }
+    done += rc;
+  }
+  return 0;
+}
+
+/**
+ * Appends entry to the index in *index, growing it as necessary.
+ */
+static int appendIndexEntry(struct capture_index_entry **index,
+                            size_t *numBlocks, size_t *cap,
+                            const struct capture_index_entry *entry) {
+  if (*numBlocks == *cap) {
+    size_t newCap = *cap == 0 ? 64 : *cap * 2;
+    struct capture_index_entry *newIndex =
+        realloc(*index, newCap * sizeof(struct capture_index_entry));
+    if (newIndex == NULL) {
+      return -1;
+    }
+    *index = newIndex;
+    *cap = newCap;
+  }
+  (*index)[(*numBlocks)++] = *entry;
+  return 0;
+}
+
+struct capture *captureOpen(const char *path, __u32 flags, __u32 sampleRate,
+                            const char *const origins[], __u32 numOrigins,
+                            enum output_flush_policy policy) {
+  struct capture *capture = calloc(1, sizeof(struct capture));
+  if (capture == NULL) {
+    return NULL;
+  }
+
+  capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (capture->fd < 0) {
+    free(capture);
+    return NULL;
+  }
+
+  struct capture_file_header header = {
+      .magic = CAPTURE_MAGIC,
+      .version = CAPTURE_VERSION,
+      .flags = flags,
+      .sampleRate = sampleRate,
+      .numOrigins = numOrigins,
+  };
+  int rc = writeAll(capture->fd, &header, sizeof(header));
+  for (__u32 i = 0; rc == 0 && i < numOrigins; i++) {
+    // Longer names are truncated, and the rest is zeroed.
+    struct capture_origin origin = {{0}};
+    strncpy(origin.name, origins[i], sizeof(origin.name) - 1);
+    rc = writeAll(capture->fd, &origin, sizeof(origin));
+  }
+  if (rc < 0) {
+    int savedErrno = errno;
+    close(capture->fd);
+    free(capture);
+    errno = savedErrno;
+    return NULL;
+  }
+
+  capture->policy = policy;
+  capture->offset = sizeof(header) + numOrigins * sizeof(struct capture_origin);
+  pthread_mutex_init(&capture->lock, NULL);
+  return capture;
+}
+
+int captureClose(struct capture *capture) {
+  struct capture_trailer trailer = {
+      .indexOffset = capture->offset,
+      .numBlocks = capture->numBlocks,
+      .magic = CAPTURE_TRAILER_MAGIC,
+  };
+  int rc = writeAll(capture->fd, capture->index,
+                    capture->numBlocks * sizeof(struct capture_index_entry));
+  if (rc == 0) {
+    rc = writeAll(capture->fd, &trailer, sizeof(trailer));
+  }
+  int savedErrno = errno;
+  if (close(capture->fd) < 0 && rc == 0) {
+    rc = -1;
+    savedErrno = errno;
+  }
+
+  pthread_mutex_destroy(&capture->lock);
+  free(capture->index);
+  free(capture);
+  errno = savedErrno;
+  return rc;
+}
+
+/**
+ * Starts a new, empty block in buf after the space for the header.
+ */
+static void resetBlock(struct capture_block *block) {
+  memset(&block->header, 0, sizeof(block->header));
+  block->len = sizeof(struct capture_block_header);
+}
+
+int captureBlockInit(struct capture_block *block) {
+  block->buf = malloc(CAPTURE_BLOCK_SIZE);
+  if (block->buf == NULL) {
+    return -1;
+  }
+  resetBlock(block);
+  return 0;
+}
+
+void captureBlockFree(struct capture_block *block) {
+  free(block->buf);
+  block->buf = NULL;
+}
+
+int captureFlushBlock(struct capture *capture, struct capture_block *block) {
+  if (block->header.numRecords == 0) {
+    return 0;
+  }
+
+  block->header.size = block->len - sizeof(struct capture_block_header);
+  memcpy(block->buf, &block->header, sizeof(block->header));
+
+  pthread_mutex_lock(&capture->lock);
+  struct capture_index_entry entry = {
+      .offset = capture->offset,
+      .firstTs = block->header.firstTs,
+      .lastTs = block->header.lastTs,
+  };
+  int rc = writeAll(capture->fd, block->buf, block->len);
+  if (rc == 0) {
+    capture->offset += block->len;
+    rc = appendIndexEntry(&capture->index, &capture->numBlocks,
+                          &capture->indexCap, &entry);
+  }
+  pthread_mutex_unlock(&capture->lock);
+
+  resetBlock(block);
+  return rc;
+}
+
+void captureAppend(struct capture *capture, struct capture_block *block,
+                   const void *event, size_t size) {
+  __u16 recordSize = size;
+  if (block->len + sizeof(recordSize) + size > CAPTURE_BLOCK_SIZE) {
+    if (captureFlushBlock(capture, block) < 0) {
+      fprintf(stderr, "Error writing to the capture file: %s\n",
+              strerror(errno));
+    }
+  }
+
+  __u64 ts = ((const struct data_t *)event)->ts;
+  if (block->header.numRecords == 0 || ts < block->header.firstTs) {
+    block->header.firstTs = ts;
+  }
+  if (block->header.numRecords == 0 || ts > block->header.lastTs) {
+    block->header.lastTs = ts;
+  }
+  block->header.numRecords++;
+
+  memcpy(block->buf + block->len, &recordSize, sizeof(recordSize));
+  memcpy(block->buf + block->len + sizeof(recordSize), event, size);
+  block->len += sizeof(recordSize) + size;
+
+  if (capture->policy == OUTPUT_FLUSH_LINE &&
+      captureFlushBlock(capture, block) < 0) {
+    fprintf(stderr, "Error writing to the capture file: %s\n",
+            strerror(errno));
+  }
+}
+
+void captureEndBatch(struct capture *capture, struct capture_block *block) {
+  if (capture->policy == OUTPUT_FLUSH_BATCH &&
+      captureFlushBlock(capture, block) < 0) {
+    fprintf(stderr, "Error writing to the capture file: %s\n",
+            strerror(errno));
+  }
+}
+
+/**
+ * Loads the index from the trailer of a capture that was closed properly.
+ * Returns 0 on success, or -1 if there is no valid trailer.
+ */
+static int readIndex(struct capture_reader *reader, off_t fileSize) {
+  struct capture_trailer trailer;
+  off_t trailerOffset = fileSize - (off_t)sizeof(trailer);
+  if (trailerOffset < (off_t)sizeof(struct capture_file_header) ||
+      preadAll(reader->fd, &trailer, sizeof(trailer), trailerOffset) < 0 ||
+      memcmp(trailer.magic, CAPTURE_TRAILER_MAGIC, sizeof(trailer.magic)) !=
+          0) {
+    return -1;
+  }
+
+  size_t indexSize = trailer.numBlocks * sizeof(struct capture_index_entry);
+  if (trailer.indexOffset + indexSize != (uint64_t)trailerOffset) {
+    return -1;
+  }
+
+  reader->index = malloc(indexSize);
+  if (reader->index == NULL && indexSize != 0) {
+    return -1;
+  }
+  if (preadAll(reader->fd, reader->index, indexSize, trailer.indexOffset) <
+      0) {
+    free(reader->index);
+    reader->index = NULL;
+    return -1;
+  }
+  reader->numBlocks = trailer.numBlocks;
+  return 0;
+}
+
+/**
+ * Rebuilds the index of a capture without a trailer from its block headers.
+ * A truncated block at the end is ignored.
+ */
+static int scanIndex(struct capture_reader *reader, off_t fileSize) {
+  size_t cap = 0;
+  off_t offset = sizeof(struct capture_file_header) +
+                 reader->numOrigins * sizeof(struct capture_origin);
+  struct capture_block_header header;
+  while (offset + (off_t)sizeof(header) <= fileSize) {
+    if (preadAll(reader->fd, &header, sizeof(header), offset) < 0) {
+      return -1;
+    }
+    off_t end = offset + sizeof(header) + header.size;
+    if (header.numRecords == 0 || end > fileSize) {
+      break;
+    }
+
+    struct capture_index_entry entry = {
+        .offset = offset,
+        .firstTs = header.firstTs,
+        .lastTs = header.lastTs,
+    };
+    if (appendIndexEntry(&reader->index, &reader->numBlocks, &cap, &entry) <
+        0) {
+      return -1;
+    }
+    offset = end;
+  }
+  return 0;
+}
+
+struct capture_reader *captureReaderOpen(const char *path) {
+  struct capture_reader *reader = calloc(1, sizeof(struct capture_reader));
+  if (reader == NULL) {
+    return NULL;
+  }
+
+  reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (reader->fd < 0) {
+    free(reader);
+    return NULL;
+  }
+
+  struct capture_file_header header;
+  off_t fileSize = lseek(reader->fd, 0, SEEK_END);
+  if (fileSize < 0 || preadAll(reader->fd, &header, sizeof(header), 0) < 0) {
+    goto error;
+  }
+  if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CAPTURE_VERSION) {
+    errno = EINVAL;
+    goto error;
+  }
+  reader->flags = header.flags;
+  reader->sampleRate = header.sampleRate;
+
+  size_t originsSize = header.numOrigins * sizeof(struct capture_origin);
+  if (header.numOrigins > MAX_ATTACH_POINTS) {
+    errno = EINVAL;
+    goto error;
+  }
+  reader->origins = malloc(originsSize);
+  if (reader->origins == NULL && originsSize != 0) {
+    goto error;
+  }
+  if (preadAll(reader->fd, reader->origins, originsSize, sizeof(header)) < 0) {
+    goto error;
+  }
+  reader->numOrigins = header.numOrigins;
+  for (__u32 i = 0; i < reader->numOrigins; i++) {
+    reader->origins[i].name[CAPTURE_ORIGIN_NAME_LEN - 1] = '\0';
+  }
+
+  if (readIndex(reader, fileSize) < 0 && scanIndex(reader, fileSize) < 0) {
+    goto error;
+  }
+
+  for (size_t i = 0; i < reader->numBlocks; i++) {
+    if (i == 0 || reader->index[i].firstTs < reader->firstTs) {
+      reader->firstTs = reader->index[i].firstTs;
+    }
+  }
+  return reader;
+
+error:;
+  int savedErrno = errno;
+  captureReaderFree(reader);
+  errno = savedErrno;
+  return NULL;
+}
+
+void captureReaderFree(struct capture_reader *reader) {
+  close(reader->fd);
+  free(reader->origins);
+  free(reader->index);
+  free(reader);
+}
+
+int captureReaderReplay(struct capture_reader *reader, __u64 startTs,
+                        __u64 endTs, capture_record_cb cb, void *cb_cookie) {
+  char *buf = malloc(CAPTURE_BLOCK_SIZE);
+  if (buf == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < reader->numBlocks; i++) {
+    struct capture_index_entry *entry = &reader->index[i];
+    if (entry->lastTs < startTs || entry->firstTs > endTs) {
+      continue;
+    }
+
+    struct capture_block_header header;
+    if (preadAll(reader->fd, &header, sizeof(header), entry->offset) < 0) {
+      goto error;
+    }
+    if (header.size > CAPTURE_BLOCK_SIZE) {
+      errno = EINVAL;
+      goto error;
+    }
+    if (preadAll(reader->fd, buf, header.size,
+                 entry->offset + sizeof(header)) < 0) {
+      goto error;
+    }
+
+    size_t offset = 0;
+    for (__u32 j = 0; j < header.numRecords; j++) {
+      __u16 recordSize;
+      if (offset + sizeof(recordSize) > header.size) {
+        errno = EINVAL;
+        goto error;
+      }
+      memcpy(&recordSize, buf + offset, sizeof(recordSize));
+      offset += sizeof(recordSize);
+      if (recordSize > sizeof(struct data_t) ||
+          offset + recordSize > header.size) {
+        errno = EINVAL;
+        goto error;
+      }
+
+      // Copied out so that the record is suitably aligned for the callback.
+      struct data_t event;
+      memcpy(&event, buf + offset, recordSize);
+      offset += recordSize;
+      if (recordSize < DATA_T_HEADER_SIZE || event.ts < startTs ||
+          event.ts > endTs) {
+        continue;
+      }
+      cb(cb_cookie, &event, recordSize);
+    }
+  }
+
+  free(buf);
+  return 0;
+
+error:;
+  int savedErrno = errno;
+  free(buf);
+  errno = savedErrno;
+  return -1;
+}
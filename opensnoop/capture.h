@@ -0,0 +1,179 @@
+/**
+ * Binary capture files written by `opensnoop -w FILE` and read back by
+ * `opensnoop -r FILE`. All integers are in host byte order. The layout is:
+ *
+ *   struct capture_file_header
+ *   origins: struct capture_origin for each of header.numOrigins attach points
+ *   block*: struct capture_block_header, then numRecords records of
+ *           a __u16 length followed by that many bytes of a struct data_t
+ *           (the header fields and the filename without its NUL terminator)
+ *   index:  struct capture_index_entry for each block, in file order
+ *   struct capture_trailer
+ *
+ * The index and trailer are only written when the capture is closed. Since
+ * each block header also carries the block's size and timestamp range, a
+ * reader can rebuild the index of a capture that was cut short by scanning
+ * the block headers.
+ */
+#pragma once
+
+#include "output.h"
+#include <linux/types.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CAPTURE_MAGIC "OSNPCAP"
+#define CAPTURE_TRAILER_MAGIC "OSNPIDX"
+#define CAPTURE_VERSION 4
+
+// Records are collected into blocks of about this size before being written.
+#define CAPTURE_BLOCK_SIZE (64 * 1024)
+
+// The traced process was selected with -t, so the first column is a TID.
+#define CAPTURE_FLAG_TID 1
+// The events were traced with --dedup, so their repeats are filled in.
+#define CAPTURE_FLAG_DEDUP 2
+// The events came from more than one attach point (see --attach-to), so their
+// origin is worth showing.
+#define CAPTURE_FLAG_ORIGIN 4
+// The events were traced with --entry-only, so they have no return value.
+#define CAPTURE_FLAG_ENTRY_ONLY 8
+
+// Size of the name of an attach point in a capture, including its NUL
+// terminator.
+#define CAPTURE_ORIGIN_NAME_LEN 64
+
+struct capture_file_header {
+  char magic[8];
+  __u32 version;
+  __u32 flags;
+  // Only 1 in sampleRate opens were traced (see --sample), so counts taken
+  // from the capture should be scaled up by it.
+  __u32 sampleRate;
+  // Number of capture_origin entries between this header and the first block.
+  __u32 numOrigins;
+};
+
+/**
+ * The name of the function or syscall that data_t.origin refers to.
+ */
+struct capture_origin {
+  char name[CAPTURE_ORIGIN_NAME_LEN];
+};
+
+struct capture_block_header {
+  // Number of bytes of records after this header.
+  __u32 size;
+  __u32 numRecords;
+  // Range of the data_t.ts values in the block. Blocks from different
+  // consumers may overlap.
+  __u64 firstTs;
+  __u64 lastTs;
+};
+
+struct capture_index_entry {
+  // File offset of the capture_block_header.
+  __u64 offset;
+  __u64 firstTs;
+  __u64 lastTs;
+};
+
+struct capture_trailer {
+  __u64 indexOffset;
+  __u64 numBlocks;
+  char magic[8];
+};
+
+/**
+ * A capture file being written, which is shared by all consumers.
+ */
+struct capture {
+  int fd;
+  enum output_flush_policy policy;
+  // Serializes writing blocks and appending to the index.
+  pthread_mutex_t lock;
+  off_t offset;
+  struct capture_index_entry *index;
+  size_t numBlocks;
+  size_t indexCap;
+};
+
+/**
+ * The block that one consumer is filling. It is written to the capture when
+ * it is full or according to the capture's flush policy.
+ */
+struct capture_block {
+  char *buf;
+  size_t len;
+  struct capture_block_header header;
+};
+
+/**
+ * Creates path and writes the file header, followed by the names of the
+ * numOrigins attach points. Returns NULL with errno set on failure.
+ */
+struct capture *captureOpen(const char *path, __u32 flags, __u32 sampleRate,
+                            const char *const origins[], __u32 numOrigins,
+                            enum output_flush_policy policy);
+
+/**
+ * Writes the index and the trailer and frees capture. All blocks must have
+ * been flushed first. Returns 0 on success or -1 with errno set.
+ */
+int captureClose(struct capture *capture);
+
+int captureBlockInit(struct capture_block *block);
+void captureBlockFree(struct capture_block *block);
+
+/**
+ * Adds the first size bytes of event to block. size must be at most
+ * sizeof(struct data_t). Errors writing a full block are reported on stderr.
+ */
+void captureAppend(struct capture *capture, struct capture_block *block,
+                   const void *event, size_t size);
+
+/**
+ * Writes block to the capture if it is not empty. Returns 0 on success or -1
+ * with errno set, in which case the block is discarded.
+ */
+int captureFlushBlock(struct capture *capture, struct capture_block *block);
+
+/**
+ * To be called at the end of a batch of events so the block is flushed
+ * according to the policy.
+ */
+void captureEndBatch(struct capture *capture, struct capture_block *block);
+
+/**
+ * A capture file opened for reading, along with its index.
+ */
+struct capture_reader {
+  int fd;
+  __u32 flags;
+  __u32 sampleRate;
+  struct capture_origin *origins;
+  __u32 numOrigins;
+  struct capture_index_entry *index;
+  size_t numBlocks;
+  // The smallest timestamp in the capture, or 0 if it is empty.
+  __u64 firstTs;
+};
+
+/**
+ * Opens path and loads its index, rebuilding it from the block headers if the
+ * capture was not closed. Returns NULL with errno set on failure.
+ */
+struct capture_reader *captureReaderOpen(const char *path);
+
+void captureReaderFree(struct capture_reader *reader);
+
+typedef void (*capture_record_cb)(void *cb_cookie, void *raw, int raw_size);
+
+/**
+ * Calls cb for every record whose timestamp is in [startTs, endTs], in the
+ * order they were written. Blocks whose range is outside of that window are
+ * skipped without being read. Returns 0 on success or -1 with errno set.
+ */
+int captureReaderReplay(struct capture_reader *reader, __u64 startTs,
+                        __u64 endTs, capture_record_cb cb, void *cb_cookie);
@@ -0,0 +1,638 @@
+#include "filter.h"
+#include "opensnoop.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum filter_field {
+  FIELD_PID,
+  FIELD_TID,
+  FIELD_UID,
+  FIELD_GID,
+  FIELD_COMM,
+  FIELD_RET,
+};
+
+static const char *const fieldNames[] = {"pid",  "tid", "uid",
+                                         "gid",  "comm", "ret"};
+
+// What the prologue has to fetch for a node to be evaluated.
+#define USES_PID_TGID 1
+#define USES_UID_GID 2
+#define USES_COMM 4
+#define USES_RET 8
+
+static const unsigned fieldUses[] = {USES_PID_TGID, USES_PID_TGID,
+                                     USES_UID_GID,  USES_UID_GID,
+                                     USES_COMM,     USES_RET};
+
+// The operation of ^=, which is not a BPF_JMP operation.
+#define PREFIX -1
+
+enum filter_node_type {
+  NODE_AND,
+  NODE_OR,
+  NODE_NOT,
+  // field op value, for every field but comm.
+  NODE_COMPARE,
+  // The first len bytes of comm are those of str. This is how == is compiled
+  // as well as ^=, with the NUL terminator as the last byte.
+  NODE_COMM_PREFIX,
+};
+
+struct filter_node {
+  enum filter_node_type type;
+  // The operands of NODE_AND and NODE_OR, and of NODE_NOT in left.
+  int left;
+  int right;
+  // For NODE_COMPARE, the BPF_JMP operation that jumps when the comparison is
+  // true, and the value that it compares the field with.
+  enum filter_field field;
+  int op;
+  long long value;
+  // For NODE_COMM_PREFIX, padded with zeros.
+  char str[TASK_COMM_LEN];
+  int len;
+  // The USES_* bits of the node and its operands.
+  unsigned uses;
+};
+
+struct filter {
+  struct filter_node nodes[FILTER_MAX_NODES];
+  int numNodes;
+  int root;
+};
+
+struct parser {
+  const char *expr;
+  const char *pos;
+  struct filter *filter;
+  // The first error, which is the only one reported, and where it is.
+  const char *error;
+  const char *errorPos;
+};
+
+static int fail(struct parser *p, const char *error) {
+  if (p->error == NULL) {
+    p->error = error;
+    p->errorPos = p->pos;
+  }
+  return -1;
+}
+
+static void skipSpace(struct parser *p) {
+  while (isspace((unsigned char)*p->pos)) {
+    p->pos++;
+  }
+}
+
+/**
+ * Consumes token if it comes next. A word only matches a whole word, so that
+ * "in" is not taken from the start of "int".
+ */
+static int accept(struct parser *p, const char *token) {
+  skipSpace(p);
+  size_t len = strlen(token);
+  if (strncmp(p->pos, token, len) != 0) {
+    return 0;
+  }
+  if (isalpha((unsigned char)token[0]) &&
+      (isalnum((unsigned char)p->pos[len]) || p->pos[len] == '_')) {
+    return 0;
+  }
+  p->pos += len;
+  return 1;
+}
+
+/**
+ * Adds a node with the given operands, or -1 for none, and returns its index,
+ * or -1 if the filter is full.
+ */
+static int newNode(struct parser *p, enum filter_node_type type, int left,
+                   int right) {
+  struct filter *filter = p->filter;
+  if (filter->numNodes == FILTER_MAX_NODES) {
+    return fail(p, "the expression is too long");
+  }
+  struct filter_node *node = &filter->nodes[filter->numNodes];
+  memset(node, 0, sizeof(*node));
+  node->type = type;
+  node->left = left;
+  node->right = right;
+  if (left >= 0) {
+    node->uses |= filter->nodes[left].uses;
+  }
+  if (right >= 0) {
+    node->uses |= filter->nodes[right].uses;
+  }
+  return filter->numNodes++;
+}
+
+/**
+ * Parses the value that field is compared with by op, a BPF_JMP operation for
+ * unsigned integers or PREFIX, and returns the node for the comparison.
+ */
+static int parseValue(struct parser *p, enum filter_field field, int op) {
+  skipSpace(p);
+  const char *start = p->pos;
+  if (field == FIELD_COMM) {
+    if (op != BPF_JEQ && op != BPF_JNE && op != PREFIX) {
+      return fail(p, "comm can only be compared with ==, !=, ^=, or in");
+    }
+    if (*p->pos != '"') {
+      return fail(p, "expected a string");
+    }
+    int index = newNode(p, NODE_COMM_PREFIX, -1, -1);
+    if (index < 0) {
+      return -1;
+    }
+    struct filter_node *node = &p->filter->nodes[index];
+    node->field = field;
+    node->uses = USES_COMM;
+    int len = 0;
+    for (p->pos++; *p->pos != '"'; p->pos++) {
+      if (*p->pos == '\0') {
+        p->pos = start;
+        return fail(p, "the string is not terminated");
+      }
+      if (len == TASK_COMM_LEN - 1) {
+        p->pos = start;
+        return fail(p, "process names are at most 15 characters");
+      }
+      if (*p->pos == '\\' && (p->pos[1] == '"' || p->pos[1] == '\\')) {
+        p->pos++;
+      }
+      node->str[len++] = *p->pos;
+    }
+    p->pos++;
+    node->len = op == PREFIX ? len : len + 1;
+    return op == BPF_JNE ? newNode(p, NODE_NOT, index, -1) : index;
+  }
+
+  if (op == PREFIX) {
+    return fail(p, "only comm can be compared with ^=");
+  }
+  char *end;
+  errno = 0;
+  long long value = strtoll(p->pos, &end, 0);
+  if (end == p->pos) {
+    return fail(p, "expected an integer");
+  }
+  // ret is an int, like -x takes it to be, and the IDs are unsigned.
+  long long min = field == FIELD_RET ? INT32_MIN : 0;
+  long long max = field == FIELD_RET ? INT32_MAX : UINT32_MAX;
+  if (errno == ERANGE || value < min || value > max) {
+    return fail(p, field == FIELD_RET ? "ret is a 32-bit signed integer"
+                                      : "IDs are 32-bit unsigned integers");
+  }
+  p->pos = end;
+  int index = newNode(p, NODE_COMPARE, -1, -1);
+  if (index < 0) {
+    return -1;
+  }
+  struct filter_node *node = &p->filter->nodes[index];
+  node->field = field;
+  node->uses = fieldUses[field];
+  node->value = value;
+  node->op = op;
+  if (field == FIELD_RET) {
+    switch (op) {
+    case BPF_JLT:
+      node->op = BPF_JSLT;
+      break;
+    case BPF_JLE:
+      node->op = BPF_JSLE;
+      break;
+    case BPF_JGT:
+      node->op = BPF_JSGT;
+      break;
+    case BPF_JGE:
+      node->op = BPF_JSGE;
+      break;
+    }
+  }
+  return index;
+}
+
+static int parseComparison(struct parser *p) {
+  int field = -1;
+  for (int i = 0; i < (int)(sizeof(fieldNames) / sizeof(fieldNames[0]));
+       i++) {
+    if (accept(p, fieldNames[i])) {
+      field = i;
+      break;
+    }
+  }
+  if (field == -1) {
+    return fail(p, "expected pid, tid, uid, gid, comm, or ret");
+  }
+
+  // A set is a chain of ||, which is as cheap as it gets for a few values.
+  if (accept(p, "in")) {
+    if (!accept(p, "{")) {
+      return fail(p, "expected '{'");
+    }
+    int set = -1;
+    do {
+      int equal = parseValue(p, field, BPF_JEQ);
+      if (equal < 0) {
+        return -1;
+      }
+      set = set == -1 ? equal : newNode(p, NODE_OR, set, equal);
+    } while (set >= 0 && accept(p, ","));
+    if (set >= 0 && !accept(p, "}")) {
+      return fail(p, "expected ',' or '}'");
+    }
+    return set;
+  }
+
+  // Longer operators come first, so that < does not take the start of <=.
+  static const struct {
+    const char *token;
+    int op;
+  } ops[] = {
+      {"==", BPF_JEQ}, {"!=", BPF_JNE}, {"<=", BPF_JLE}, {">=", BPF_JGE},
+      {"<", BPF_JLT},  {">", BPF_JGT},  {"^=", PREFIX},
+  };
+  for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+    if (accept(p, ops[i].token)) {
+      return parseValue(p, field, ops[i].op);
+    }
+  }
+  return fail(p, "expected ==, !=, <, <=, >, >=, ^=, or in");
+}
+
+static int parseExpr(struct parser *p);
+
+static int parseUnary(struct parser *p) {
+  if (accept(p, "!")) {
+    int operand = parseUnary(p);
+    return operand < 0 ? -1 : newNode(p, NODE_NOT, operand, -1);
+  }
+  if (accept(p, "(")) {
+    int expr = parseExpr(p);
+    if (expr >= 0 && !accept(p, ")")) {
+      return fail(p, "expected ')'");
+    }
+    return expr;
+  }
+  return parseComparison(p);
+}
+
+static int parseAnd(struct parser *p) {
+  int left = parseUnary(p);
+  while (left >= 0 && accept(p, "&&")) {
+    int right = parseUnary(p);
+    left = right < 0 ? -1 : newNode(p, NODE_AND, left, right);
+  }
+  return left;
+}
+
+static int parseExpr(struct parser *p) {
+  int left = parseAnd(p);
+  while (left >= 0 && accept(p, "||")) {
+    int right = parseAnd(p);
+    left = right < 0 ? -1 : newNode(p, NODE_OR, left, right);
+  }
+  return left;
+}
+
+struct filter *filterParse(const char *expr) {
+  struct filter *filter = calloc(1, sizeof(*filter));
+  if (filter == NULL) {
+    perror("Failed to allocate the filter");
+    return NULL;
+  }
+  struct parser p = {.expr = expr, .pos = expr, .filter = filter};
+  filter->root = parseExpr(&p);
+  if (filter->root >= 0) {
+    skipSpace(&p);
+    if (*p.pos != '\0') {
+      fail(&p, "expected &&, ||, or the end of the expression");
+    }
+  }
+  if (p.error != NULL) {
+    fprintf(stderr, "Invalid value for --filter: %s\n  %s\n  %*s^\n", p.error,
+            expr, (int)(p.errorPos - expr), "");
+    free(filter);
+    return NULL;
+  }
+  return filter;
+}
+
+void filterFree(struct filter *filter) { free(filter); }
+
+int filterUsesReturn(const struct filter *filter) {
+  return (filter->nodes[filter->root].uses & USES_RET) != 0;
+}
+
+// The prologue keeps the context in r6 for the program after it, and what it
+// fetches in r7 to r9, which helpers leave alone.
+#define REG_CTX 6
+#define REG_PID_TGID 7
+#define REG_UID_GID 8
+#define REG_RET 9
+// Where FILTER_RETURN leaves whether the open was filtered out, for
+// PROGRAM_FILTERED.
+#define REG_FILTERED 9
+// get_current_comm() writes comm right below the frame pointer.
+#define COMM_OFFSET (-TASK_COMM_LEN)
+
+struct compiler {
+  const struct filter *filter;
+  struct bpf_insn *insns;
+  int numInsns;
+  // Set once an instruction did not fit.
+  int overflow;
+  // Where each label is bound, or -1. Every && and ||, and every comm
+  // comparison, takes at most one, along with the prologue's two.
+  int labels[FILTER_MAX_NODES + 2];
+  int numLabels;
+  // The jumps whose off is the distance to a label.
+  struct {
+    int insn;
+    int label;
+  } fixups[FILTER_MAX_INSTRUCTIONS];
+  int numFixups;
+};
+
+static void emit(struct compiler *c, __u8 code, __u8 dst, __u8 src, __s16 off,
+                 __s32 imm) {
+  if (c->numInsns == FILTER_MAX_INSTRUCTIONS) {
+    c->overflow = 1;
+    return;
+  }
+  c->insns[c->numInsns++] = (struct bpf_insn){
+      .code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm};
+}
+
+static int newLabel(struct compiler *c) {
+  c->labels[c->numLabels] = -1;
+  return c->numLabels++;
+}
+
+static void bind(struct compiler *c, int label) {
+  c->labels[label] = c->numInsns;
+}
+
+// Emits a jump to label, whose off is filled in once label is bound.
+static void jump(struct compiler *c, int label, __u8 code, __u8 dst, __u8 src,
+                 __s32 imm) {
+  if (c->numInsns == FILTER_MAX_INSTRUCTIONS) {
+    c->overflow = 1;
+    return;
+  }
+  c->fixups[c->numFixups].insn = c->numInsns;
+  c->fixups[c->numFixups].label = label;
+  c->numFixups++;
+  emit(c, code, dst, src, 0, imm);
+}
+
+// if reg op value goto label
+static void jumpIf(struct compiler *c, int op, __u8 reg, __s64 value,
+                   int label) {
+  if (value >= INT32_MIN && value <= INT32_MAX) {
+    jump(c, label, BPF_JMP | op | BPF_K, reg, 0, value);
+  } else {
+    // An immediate is sign-extended to 64 bits, so anything else needs a
+    // register.
+    emit(c, BPF_LD | BPF_DW | BPF_IMM, 1, 0, 0, (__u32)value);
+    emit(c, 0, 0, 0, 0, (__u32)((__u64)value >> 32));
+    jump(c, label, BPF_JMP | op | BPF_X, reg, 1, 0);
+  }
+}
+
+// The operation that jumps exactly when op does not.
+static int negate(int op) {
+  switch (op) {
+  case BPF_JEQ:
+    return BPF_JNE;
+  case BPF_JNE:
+    return BPF_JEQ;
+  case BPF_JLT:
+    return BPF_JGE;
+  case BPF_JGE:
+    return BPF_JLT;
+  case BPF_JLE:
+    return BPF_JGT;
+  case BPF_JGT:
+    return BPF_JLE;
+  case BPF_JSLT:
+    return BPF_JSGE;
+  case BPF_JSGE:
+    return BPF_JSLT;
+  case BPF_JSLE:
+    return BPF_JSGT;
+  default:
+    return BPF_JSLE;
+  }
+}
+
+/**
+ * Compares comm a chunk of 8, 4, 2, or 1 bytes at a time, so that each chunk
+ * is one load and one compare, with no masking.
+ */
+static void compileCommPrefix(struct compiler *c,
+                              const struct filter_node *node, int label,
+                              int jumpIfTrue) {
+  if (node->len == 0) {
+    if (jumpIfTrue) {
+      jump(c, label, BPF_JMP | BPF_JA, 0, 0, 0);
+    }
+    return;
+  }
+  // Any chunk that differs means no match.
+  int noMatch = jumpIfTrue ? newLabel(c) : label;
+  for (int off = 0; off < node->len;) {
+    int size = node->len - off >= 8   ? 8
+               : node->len - off >= 4 ? 4
+               : node->len - off >= 2 ? 2
+                                      : 1;
+    // The value that loading the chunk gives, in host byte order like the
+    // load.
+    __s64 value;
+    __u8 sizeCode;
+    if (size == 8) {
+      __u64 chunk;
+      memcpy(&chunk, node->str + off, size);
+      value = chunk;
+      sizeCode = BPF_DW;
+    } else if (size == 4) {
+      __u32 chunk;
+      memcpy(&chunk, node->str + off, size);
+      value = chunk;
+      sizeCode = BPF_W;
+    } else if (size == 2) {
+      __u16 chunk;
+      memcpy(&chunk, node->str + off, size);
+      value = chunk;
+      sizeCode = BPF_H;
+    } else {
+      value = (__u8)node->str[off];
+      sizeCode = BPF_B;
+    }
+    emit(c, BPF_LDX | sizeCode | BPF_MEM, 0, 10, COMM_OFFSET + off, 0);
+    off += size;
+    if (jumpIfTrue && off == node->len) {
+      jumpIf(c, BPF_JEQ, 0, value, label);
+    } else {
+      jumpIf(c, BPF_JNE, 0, value, noMatch);
+    }
+  }
+  if (jumpIfTrue) {
+    bind(c, noMatch);
+  }
+}
+
+/**
+ * Emits the node at index so that it jumps to label if it is jumpIfTrue, and
+ * falls through otherwise, which is what lets && and || short-circuit.
+ */
+static void compileNode(struct compiler *c, int index, int label,
+                        int jumpIfTrue) {
+  const struct filter_node *node = &c->filter->nodes[index];
+  switch (node->type) {
+  case NODE_AND:
+  case NODE_OR: {
+    // The left operand alone decides a || that is true or a && that is false.
+    int decides = node->type == NODE_OR;
+    if (decides == jumpIfTrue) {
+      compileNode(c, node->left, label, jumpIfTrue);
+      compileNode(c, node->right, label, jumpIfTrue);
+    } else {
+      int skip = newLabel(c);
+      compileNode(c, node->left, skip, decides);
+      compileNode(c, node->right, label, jumpIfTrue);
+      bind(c, skip);
+    }
+    break;
+  }
+  case NODE_NOT:
+    compileNode(c, node->left, label, !jumpIfTrue);
+    break;
+  case NODE_COMPARE: {
+    int op = jumpIfTrue ? node->op : negate(node->op);
+    // Each ID is one half of what its helper returned, and a 32-bit mov
+    // zeroes the upper half.
+    __u8 reg = 0;
+    switch (node->field) {
+    case FIELD_PID:
+      emit(c, BPF_ALU64 | BPF_MOV | BPF_X, 0, REG_PID_TGID, 0, 0);
+      emit(c, BPF_ALU64 | BPF_RSH | BPF_K, 0, 0, 0, 32);
+      break;
+    case FIELD_TID:
+      emit(c, BPF_ALU | BPF_MOV | BPF_X, 0, REG_PID_TGID, 0, 0);
+      break;
+    case FIELD_UID:
+      emit(c, BPF_ALU | BPF_MOV | BPF_X, 0, REG_UID_GID, 0, 0);
+      break;
+    case FIELD_GID:
+      emit(c, BPF_ALU64 | BPF_MOV | BPF_X, 0, REG_UID_GID, 0, 0);
+      emit(c, BPF_ALU64 | BPF_RSH | BPF_K, 0, 0, 0, 32);
+      break;
+    case FIELD_RET:
+      reg = REG_RET;
+      break;
+    case FIELD_COMM:
+      break;
+    }
+    jumpIf(c, op, reg, node->value, label);
+    break;
+  }
+  case NODE_COMM_PREFIX:
+    compileCommPrefix(c, node, label, jumpIfTrue);
+    break;
+  }
+}
+
+/**
+ * Adds the nodes that make up part of the filter below index to conjuncts,
+ * along with what they use to *uses.
+ */
+static void collectConjuncts(const struct filter *filter, int index,
+                             enum filter_part part, int conjuncts[],
+                             int *numConjuncts, unsigned *uses) {
+  const struct filter_node *node = &filter->nodes[index];
+  if (part != FILTER_ALL && node->type == NODE_AND) {
+    collectConjuncts(filter, node->left, part, conjuncts, numConjuncts, uses);
+    collectConjuncts(filter, node->right, part, conjuncts, numConjuncts, uses);
+    return;
+  }
+  int onReturn = (node->uses & USES_RET) != 0;
+  if (part == FILTER_ALL || onReturn == (part == FILTER_RETURN)) {
+    conjuncts[(*numConjuncts)++] = index;
+    *uses |= node->uses;
+  }
+}
+
+int filterCompile(const struct filter *filter, enum filter_part part,
+                  int retOffset, struct bpf_insn insns[]) {
+  int conjuncts[FILTER_MAX_NODES];
+  int numConjuncts = 0;
+  unsigned uses = 0;
+  collectConjuncts(filter, filter->root, part, conjuncts, &numConjuncts,
+                   &uses);
+  if (numConjuncts == 0) {
+    return 0;
+  }
+
+  struct compiler c = {.filter = filter, .insns = insns};
+  int drop = newLabel(&c);
+  int pass = newLabel(&c);
+  emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, REG_CTX, 1, 0, 0);
+  // Each helper is called once, however many comparisons use what it returns.
+  if (uses & USES_RET) {
+    // Like -x, this only looks at the int in the low half.
+    emit(&c, BPF_LDX | BPF_DW | BPF_MEM, REG_RET, REG_CTX, retOffset, 0);
+    emit(&c, BPF_ALU64 | BPF_LSH | BPF_K, REG_RET, 0, 0, 32);
+    emit(&c, BPF_ALU64 | BPF_ARSH | BPF_K, REG_RET, 0, 0, 32);
+  }
+  if (uses & USES_PID_TGID) {
+    emit(&c, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_current_pid_tgid);
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, REG_PID_TGID, 0, 0, 0);
+  }
+  if (uses & USES_UID_GID) {
+    emit(&c, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_current_uid_gid);
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, REG_UID_GID, 0, 0, 0);
+  }
+  if (uses & USES_COMM) {
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, 1, 10, 0, 0);
+    emit(&c, BPF_ALU64 | BPF_ADD | BPF_K, 1, 0, 0, COMM_OFFSET);
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, 2, 0, 0, TASK_COMM_LEN);
+    emit(&c, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_current_comm);
+  }
+  for (int i = 0; i < numConjuncts; i++) {
+    compileNode(&c, conjuncts[i], drop, /* jumpIfTrue */ 0);
+  }
+  if (part == FILTER_RETURN) {
+    // trace_return still has to delete what trace_entry saved for an open
+    // that is dropped, so it is told instead of being skipped.
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, REG_FILTERED, 0, 0, 0);
+    jump(&c, pass, BPF_JMP | BPF_JA, 0, 0, 0);
+    bind(&c, drop);
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, REG_FILTERED, 0, 0, 1);
+    bind(&c, pass);
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, 1, REG_CTX, 0, 0);
+  } else {
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, 1, REG_CTX, 0, 0);
+    jump(&c, pass, BPF_JMP | BPF_JA, 0, 0, 0);
+    bind(&c, drop);
+    emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, 0);
+    emit(&c, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    bind(&c, pass);
+  }
+  if (c.overflow) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  // Jumps are relative to the next instruction.
+  for (int i = 0; i < c.numFixups; i++) {
+    int insn = c.fixups[i].insn;
+    insns[insn].off = c.labels[c.fixups[i].label] - insn - 1;
+  }
+  return c.numInsns;
+}
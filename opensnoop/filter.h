@@ -0,0 +1,65 @@
+/**
+ * The expression language of --filter, for example
+ *
+ *   pid in {1, 2} && uid != 0 && comm ^= "java"
+ *
+ * which is parsed once at startup and compiled into BPF instructions that run
+ * ahead of the programs, so the kernel only pays for the predicate that was
+ * asked for. The grammar is:
+ *
+ *   expr       := and ("||" and)*
+ *   and        := unary ("&&" unary)*
+ *   unary      := "!" unary | "(" expr ")" | comparison
+ *   comparison := field op value | field "in" "{" value ("," value)* "}"
+ *   field      := "pid" | "tid" | "uid" | "gid" | "comm" | "ret"
+ *   op         := "==" | "!=" | "<" | "<=" | ">" | ">=" | "^="
+ *
+ * where a value is an integer, or a double-quoted string for comm, which only
+ * takes ==, !=, ^= (starts with), and in. ret is the return value of the open,
+ * so a negative errno when it fails.
+ */
+#pragma once
+#include <linux/bpf.h>
+
+// The most instructions that filterCompile() emits, and the most nodes that an
+// expression parses into, which bounds that.
+#define FILTER_MAX_INSTRUCTIONS 512
+#define FILTER_MAX_NODES 64
+
+struct filter;
+
+// Which part of a filter to compile.
+enum filter_part {
+  // The comparisons that can be made where the open starts: the operands of
+  // the top-level && that do not involve ret.
+  FILTER_ENTRY,
+  // The rest, for where the open returns.
+  FILTER_RETURN,
+  // All of it, for a program that sees the whole open at once.
+  FILTER_ALL,
+};
+
+/**
+ * Parses expr. Returns the filter, or NULL after printing where expr is wrong
+ * to stderr.
+ */
+struct filter *filterParse(const char *expr);
+
+void filterFree(struct filter *filter);
+
+/**
+ * Whether filter compares ret, which is only known where the open returns.
+ */
+int filterUsesReturn(const struct filter *filter);
+
+/**
+ * Fills in insns, which must have room for FILTER_MAX_INSTRUCTIONS, with a
+ * prologue that evaluates part of filter and returns 0 from the program if it
+ * is false, and otherwise falls through with r1 as it was. FILTER_RETURN
+ * always falls through, with r9 set to whether the part is false, for a
+ * trace_return with PROGRAM_FILTERED. retOffset is where ret is in the
+ * context. Returns the number of instructions, which is 0 if the
+ * part is empty, or -1 with errno set to E2BIG if it is too long.
+ */
+int filterCompile(const struct filter *filter, enum filter_part part,
+                  int retOffset, struct bpf_insn insns[]);
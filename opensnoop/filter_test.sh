@@ -0,0 +1,29 @@
+#!/bin/sh
+# Checks that the opens that --filter drops where they return do not leave
+# what trace_entry saved behind in infotmp. Like opensnoop itself, this must be
+# run with sudo, after build.sh.
+set -e
+# An unusual size, which is how infotmp_count finds the map.
+MAX_INFLIGHT=4099
+PROCESSES=200
+clang infotmp_count.c -O2 -o infotmp_count
+
+./opensnoop --attach tracepoint --entry-state hash \
+  --max-inflight $MAX_INFLIGHT --filter 'ret < 0' > /dev/null &
+pid=$!
+trap 'kill $pid 2>/dev/null' EXIT
+# Give opensnoop time to load and attach its programs.
+sleep 2
+
+# Every process opens under its own pid_tgid, so each of them would leave an
+# entry of its own.
+for i in $(seq $PROCESSES); do
+  cat /dev/null
+done
+entries=$(./infotmp_count $MAX_INFLIGHT)
+# Allow for the opens of other processes that are in flight.
+if [ "$entries" -ge 10 ]; then
+  echo "FAIL: $entries entries left in infotmp after $PROCESSES processes"
+  exit 1
+fi
+echo "PASS: $entries entries left in infotmp after $PROCESSES processes"
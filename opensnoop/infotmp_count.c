@@ -0,0 +1,89 @@
+/**
+ * Prints how many opens are waiting in infotmp for trace_return, as kept by
+ * an opensnoop that runs with --entry-state hash --max-inflight MAX_ENTRIES.
+ * The map has no usable name, so it is found as the LRU hash with that many
+ * entries, and filter_test.sh picks an unusual number. This goes straight to
+ * bpf(2) so it does not need bpftool.
+ */
+
+#include <errno.h>
+#include <linux/bpf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Returns an fd for the LRU hash with maxEntries entries, or -1 with errno
+ * set: ENOENT if there is none.
+ */
+int findMap(__u32 maxEntries) {
+  union bpf_attr attr;
+  __u32 id = 0;
+  while (1) {
+    memset(&attr, 0, sizeof(attr));
+    attr.start_id = id;
+    if (bpf(BPF_MAP_GET_NEXT_ID, &attr) < 0) {
+      return -1;
+    }
+    id = attr.next_id;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_id = id;
+    int fd = bpf(BPF_MAP_GET_FD_BY_ID, &attr);
+    if (fd < 0) {
+      // It went away in the meantime.
+      continue;
+    }
+    struct bpf_map_info info;
+    memset(&info, 0, sizeof(info));
+    memset(&attr, 0, sizeof(attr));
+    attr.info.bpf_fd = fd;
+    attr.info.info_len = sizeof(info);
+    attr.info.info = (__u64)(unsigned long)&info;
+    if (bpf(BPF_OBJ_GET_INFO_BY_FD, &attr) == 0 &&
+        info.type == BPF_MAP_TYPE_LRU_HASH &&
+        info.max_entries == maxEntries && info.key_size == sizeof(__u64)) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: infotmp_count MAX_ENTRIES\n");
+    return 1;
+  }
+  int fd = findMap(atoi(argv[1]));
+  if (fd < 0) {
+    perror("Error finding infotmp");
+    return 1;
+  }
+
+  __u64 key, nextKey;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  // No key starts from the first one.
+  attr.key = 0;
+  attr.next_key = (__u64)(unsigned long)&nextKey;
+  long count = 0;
+  while (bpf(BPF_MAP_GET_NEXT_KEY, &attr) == 0) {
+    count++;
+    key = nextKey;
+    attr.key = (__u64)(unsigned long)&key;
+  }
+  if (errno != ENOENT) {
+    perror("Error iterating over infotmp");
+    return 1;
+  }
+  printf("%ld\n", count);
+  close(fd);
+  return 0;
+}
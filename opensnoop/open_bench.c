@@ -0,0 +1,71 @@
+/**
+ * Opens and closes a file in a loop and prints how long each open took on
+ * average, in nanoseconds. bench.sh runs it with and without opensnoop to
+ * measure how much tracing adds to every open, and with each open syscall to
+ * check which of them opensnoop sees.
+ */
+
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 1000000
+
+/**
+ * Opens path read-only with the open syscall called syscallName, bypassing
+ * libc, which implements open() with openat. Returns -2 if syscallName is not
+ * one of those.
+ */
+int openWith(const char *syscallName, const char *path) {
+  if (strcmp(syscallName, "openat") == 0) {
+    return syscall(SYS_openat, AT_FDCWD, path, O_RDONLY);
+  } else if (strcmp(syscallName, "openat2") == 0) {
+    struct open_how how = {.flags = O_RDONLY};
+    return syscall(SYS_openat2, AT_FDCWD, path, &how, sizeof(how));
+#ifdef SYS_open
+  } else if (strcmp(syscallName, "open") == 0) {
+    return syscall(SYS_open, path, O_RDONLY);
+#endif
+  }
+  return -2;
+}
+
+void usage() {
+  fprintf(stderr, "usage: open_bench [ITERATIONS [PATH [SYSCALL]]]\n"
+                  "SYSCALL is open, openat (the default), or openat2\n");
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+  const char *path = argc > 2 ? argv[2] : "/dev/null";
+  const char *syscallName = argc > 3 ? argv[3] : "openat";
+  if (iterations <= 0) {
+    usage();
+    return 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < iterations; i++) {
+    int fd = openWith(syscallName, path);
+    if (fd == -2) {
+      usage();
+      return 1;
+    } else if (fd < 0) {
+      perror("Error opening the file");
+      return 1;
+    }
+    close(fd);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  long long elapsedNs = (end.tv_sec - start.tv_sec) * 1000000000LL +
+                        (end.tv_nsec - start.tv_nsec);
+  printf("%lld\n", elapsedNs / iterations);
+  return 0;
+}
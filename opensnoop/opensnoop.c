@@ -1,20 +1,68 @@
+// For pthread_setaffinity_np() and the CPU_SET() macros.
+#define _GNU_SOURCE
 #include "opensnoop.h"
-#include "generated_bytecode.h"
+#include "btf.h"
+#include "capture.h"
+#include "filter.h"
+#include "output.h"
+#include "programs.h"
 #include <bcc/libbpf.h>
 #include <bcc/perf_reader.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <linux/magic.h>
+#include <linux/perf_event.h>
 #include <linux/version.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
 #include <time.h>
 #include <unistd.h>
 
 char bpf_log_buf[LOG_BUF_SIZE];
 
+// Size of each per-CPU perf buffer, which is what open_perf_buffer() in
+// bcc/table.py defaults to.
+#define PERF_BUFFER_PAGE_CNT 64
+
+// Size of the single ring buffer shared by all CPUs when --ringbuf is used.
+// This must be a power of 2. Because the producers on every CPU share it, it
+// can be a lot smaller than PERF_BUFFER_PAGE_CNT * numCpu: on a 128-core box
+// this is 4 MiB instead of 32 MiB of perf buffers.
+#define RINGBUF_PAGE_CNT 1024
+
+// Events are variable-length, so --wakeup-events with --ringbuf assumes each
+// takes this much space: the ring buffer header plus a data_t with a 64-byte
+// filename, rounded up to the 8-byte alignment of ring buffer records.
+#define RINGBUF_TYPICAL_RECORD_SIZE                                            \
+  ((BPF_RINGBUF_HDR_SZ + DATA_T_HEADER_SIZE + 64 + 7) & ~7)
+
+// Upper bound on how long an event can sit in a buffer when wakeups are
+// batched with --wakeup-events or --wakeup-bytes and --max-latency is not
+// specified.
+#define DEFAULT_MAX_LATENCY_MS 100
+
+// Bounds and policy for --adaptive perf buffer sizing. Every
+// ADAPTIVE_INTERVAL_MS, a CPU whose buffer lost more than
+// ADAPTIVE_LOSS_THRESHOLD of its events since the last check has its buffer
+// doubled, and one that has not seen any events for ADAPTIVE_IDLE_INTERVALS
+// checks in a row has its buffer halved. Perf buffer sizes must be a power of
+// 2 pages.
+#define ADAPTIVE_INTERVAL_MS 1000
+#define ADAPTIVE_LOSS_THRESHOLD 0.01
+#define ADAPTIVE_IDLE_INTERVALS 10
+#define ADAPTIVE_MIN_PAGE_CNT 8
+#define ADAPTIVE_MAX_PAGE_CNT 1024
+
 /**
  * If a positive integer is parsed successfully, returns the value.
  * If not, returns -1 and errno is set.
@@ -32,6 +80,123 @@ int parseNonNegativeInteger(const char *str) {
   }
 }
 
+/**
+ * Parses a comma-separated list of PIDs or TIDs for -p or -t and, if mapFd is
+ * not -1, adds them to the pids map. Returns the number of IDs, or -1 with
+ * errno set.
+ */
+int parseIdList(const char *list, int mapFd) {
+  int numIds = 0;
+  const char *start = list;
+  while (*start != '\0') {
+    char *end;
+    errno = 0;
+    long id = strtol(start, &end, /* base */ 10);
+    if (errno != 0 || end == start || id < 0 || id > UINT_MAX ||
+        (*end != ',' && *end != '\0')) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    __u32 key = id;
+    __u8 value = 1;
+    if (mapFd != -1 && bpf_update_elem(mapFd, &key, &value, BPF_ANY) < 0) {
+      return -1;
+    }
+    numIds++;
+    start = *end == ',' ? end + 1 : end;
+  }
+  return numIds;
+}
+
+/**
+ * Adds the processes (or with threads, the threads) that are currently in the
+ * cgroup at path to the pids map. Returns the number of IDs, or -1 with errno
+ * set.
+ */
+int addCgroupIds(const char *path, int threads, int mapFd) {
+  char filePath[PATH_MAX];
+  // cgroup v1 has no cgroup.threads, but its tasks file is the same thing.
+  const char *fileNames[] = {threads ? "cgroup.threads" : "cgroup.procs",
+                             threads ? "tasks" : NULL};
+  FILE *file = NULL;
+  for (int i = 0; file == NULL && i < 2 && fileNames[i] != NULL; i++) {
+    snprintf(filePath, sizeof(filePath), "%s/%s", path, fileNames[i]);
+    file = fopen(filePath, "re");
+  }
+  if (file == NULL) {
+    return -1;
+  }
+
+  int numIds = 0;
+  unsigned int id;
+  while (fscanf(file, "%u", &id) == 1) {
+    __u32 key = id;
+    __u8 value = 1;
+    if (bpf_update_elem(mapFd, &key, &value, BPF_ANY) < 0) {
+      int savedErrno = errno;
+      fclose(file);
+      errno = savedErrno;
+      return -1;
+    }
+    numIds++;
+  }
+  fclose(file);
+  return numIds;
+}
+
+/**
+ * Resolves the -p or -t arguments into the pids map, where each one is either
+ * a list of IDs or the absolute path of a cgroup.
+ */
+int addIds(char **args, int numArgs, int threads, int mapFd) {
+  for (int i = 0; i < numArgs; i++) {
+    int rc = args[i][0] == '/' ? addCgroupIds(args[i], threads, mapFd)
+                               : parseIdList(args[i], mapFd);
+    if (rc < 0) {
+      fprintf(stderr, "Error adding the IDs for -%c %s: %s\n",
+              threads ? 't' : 'p', args[i], strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Looks up the ID that bpf_get_current_cgroup_id() returns for the tasks in the
+ * cgroup v2 directory at path, which is the kernfs node ID in its file handle.
+ * Returns 0 on success or -1 with errno set.
+ */
+int getCgroupId(const char *path, __u64 *id) {
+  struct statfs fs;
+  if (statfs(path, &fs) < 0) {
+    return -1;
+  }
+  // cgroup v1 directories have IDs too, but they are not what the helper
+  // returns.
+  if (fs.f_type != CGROUP2_SUPER_MAGIC) {
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  union {
+    struct file_handle handle;
+    char buf[sizeof(struct file_handle) + sizeof(__u64)];
+  } fh;
+  int mountId;
+  fh.handle.handle_bytes = sizeof(__u64);
+  if (name_to_handle_at(AT_FDCWD, path, &fh.handle, &mountId, /* flags */ 0) <
+      0) {
+    return -1;
+  }
+  if (fh.handle.handle_bytes != sizeof(__u64)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(id, fh.handle.f_handle, sizeof(__u64));
+  return 0;
+}
+
 /**
  * A considerably more laborious implementation of get_online_cpus()
  * compared to the Python code in the bcc repo:
@@ -93,7 +258,7 @@ int getOnlineCpus(int **cpus, size_t *numCpu) {
       int extraSpace = capacity - numElements - numCpusToAdd;
       if (extraSpace < 0) {
         size_t newSize = capacity - extraSpace;
-        *cpus = realloc(cpus, newSize * sizeof(int));
+        *cpus = realloc(*cpus, newSize * sizeof(int));
         if (*cpus == NULL) {
           return -1;
         }
@@ -115,18 +280,319 @@ int getOnlineCpus(int **cpus, size_t *numCpu) {
   return 0;
 }
 
+/**
+ * Port of bpf_open_perf_buffer() from libbpf.c that also controls when the
+ * consumer is woken up: after every wakeupEvents samples or, if wakeupBytes
+ * is non-zero, once at least that many bytes are waiting in the buffer.
+ * (bpf_open_perf_buffer() always uses wakeup_events = 1.)
+ */
+struct perf_reader *openPerfBuffer(perf_reader_raw_cb raw_cb,
+                                   perf_reader_lost_cb lost_cb,
+                                   void *cb_cookie, int cpu, int page_cnt,
+                                   int wakeupEvents, int wakeupBytes) {
+  struct perf_event_attr attr = {};
+  attr.config = PERF_COUNT_SW_BPF_OUTPUT;
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.sample_type = PERF_SAMPLE_RAW;
+  attr.sample_period = 1;
+  if (wakeupBytes > 0) {
+    attr.watermark = 1;
+    attr.wakeup_watermark = wakeupBytes;
+  } else {
+    attr.wakeup_events = wakeupEvents;
+  }
+
+  int pfd = syscall(__NR_perf_event_open, &attr, /* pid */ -1, cpu,
+                    /* group_fd */ -1, PERF_FLAG_FD_CLOEXEC);
+  if (pfd < 0) {
+    return NULL;
+  }
+
+  struct perf_reader *reader =
+      perf_reader_new(raw_cb, lost_cb, cb_cookie, page_cnt);
+  if (reader == NULL) {
+    close(pfd);
+    return NULL;
+  }
+
+  // From here on, pfd is owned by the reader.
+  perf_reader_set_fd(reader, pfd);
+  if (perf_reader_mmap(reader) < 0 ||
+      ioctl(pfd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+    int savedErrno = errno;
+    perf_reader_free(reader);
+    errno = savedErrno;
+    return NULL;
+  }
+
+  return reader;
+}
+
+/**
+ * Reads whatever is in each of the perf buffers, whether or not it has reached
+ * the point where the kernel would wake us up for it.
+ */
+void drainPerfBuffers(int num_readers, struct perf_reader **readers) {
+  for (int i = 0; i < num_readers; i++) {
+    perf_reader_event_read(readers[i]);
+  }
+}
+
+/**
+ * Consumer for a BPF_MAP_TYPE_RINGBUF map (Linux 5.8+). The version of libbcc
+ * that provides perf_reader has no equivalent for ring buffers, so this reads
+ * the mmap'ed memory directly, following the layout in kernel/bpf/ringbuf.c:
+ *
+ * - page 0 contains consumer_pos and is the only page we may write to;
+ * - page 1 contains producer_pos;
+ * - the data pages follow and are mapped twice in a row by the kernel, so a
+ *   record that wraps around the end of the buffer is still contiguous.
+ */
+struct ringbuf_reader {
+  int mapFd;
+  int epollFd;
+  size_t pageSize;
+  // Size of the data area in bytes. Always a power of 2.
+  size_t size;
+  unsigned long *consumerPos;
+  unsigned long *producerPos;
+  char *data;
+  perf_reader_raw_cb raw_cb;
+  void *cb_cookie;
+};
+
+void ringbufReaderFree(struct ringbuf_reader *reader) {
+  if (reader->consumerPos != NULL) {
+    munmap(reader->consumerPos, reader->pageSize);
+  }
+  if (reader->producerPos != NULL) {
+    munmap(reader->producerPos, reader->pageSize + 2 * reader->size);
+  }
+  if (reader->epollFd != -1) {
+    close(reader->epollFd);
+  }
+  free(reader);
+}
+
+/**
+ * Returns NULL and sets errno on failure. The map fd remains owned by the
+ * caller.
+ */
+struct ringbuf_reader *ringbufReaderNew(int mapFd, size_t size,
+                                        perf_reader_raw_cb raw_cb,
+                                        void *cb_cookie) {
+  struct ringbuf_reader *reader = calloc(1, sizeof(struct ringbuf_reader));
+  if (reader == NULL) {
+    return NULL;
+  }
+  reader->mapFd = mapFd;
+  reader->epollFd = -1;
+  reader->pageSize = sysconf(_SC_PAGESIZE);
+  reader->size = size;
+  reader->raw_cb = raw_cb;
+  reader->cb_cookie = cb_cookie;
+
+  void *consumer = mmap(NULL, reader->pageSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, mapFd, /* offset */ 0);
+  if (consumer == MAP_FAILED) {
+    goto error;
+  }
+  reader->consumerPos = consumer;
+
+  void *producer = mmap(NULL, reader->pageSize + 2 * size, PROT_READ,
+                        MAP_SHARED, mapFd, /* offset */ reader->pageSize);
+  if (producer == MAP_FAILED) {
+    goto error;
+  }
+  reader->producerPos = producer;
+  reader->data = (char *)producer + reader->pageSize;
+
+  // The map fd becomes readable whenever the BPF program submits a record
+  // with wakeup enabled (the default for ringbuf_submit(data, 0)).
+  reader->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (reader->epollFd < 0) {
+    goto error;
+  }
+  struct epoll_event event = {.events = EPOLLIN};
+  if (epoll_ctl(reader->epollFd, EPOLL_CTL_ADD, mapFd, &event) < 0) {
+    goto error;
+  }
+
+  return reader;
+
+error:;
+  int savedErrno = errno;
+  ringbufReaderFree(reader);
+  errno = savedErrno;
+  return NULL;
+}
+
+/**
+ * Calls raw_cb for every record that has been committed since the last call.
+ */
+void ringbufReaderConsume(struct ringbuf_reader *reader) {
+  unsigned long consumerPos = *reader->consumerPos;
+  unsigned long producerPos =
+      __atomic_load_n(reader->producerPos, __ATOMIC_ACQUIRE);
+  while (consumerPos < producerPos) {
+    __u32 *header =
+        (__u32 *)(reader->data + (consumerPos & (reader->size - 1)));
+    __u32 len = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+    if (len & BPF_RINGBUF_BUSY_BIT) {
+      // The producer that reserved this record has not submitted it yet, so
+      // neither it nor anything after it can be read. We will be woken up
+      // again when it is submitted.
+      break;
+    }
+
+    int discarded = len & BPF_RINGBUF_DISCARD_BIT;
+    len &= ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+    if (!discarded) {
+      reader->raw_cb(reader->cb_cookie, (char *)header + BPF_RINGBUF_HDR_SZ,
+                     len);
+    }
+
+    // Records are 8-byte aligned.
+    consumerPos += (len + BPF_RINGBUF_HDR_SZ + 7) & ~7UL;
+    __atomic_store_n(reader->consumerPos, consumerPos, __ATOMIC_RELEASE);
+
+    if (consumerPos == producerPos) {
+      producerPos = __atomic_load_n(reader->producerPos, __ATOMIC_ACQUIRE);
+    }
+  }
+}
+
+/**
+ * Counterpart of perf_reader_poll() for a single ring buffer. Returns 0 on
+ * success or -1 with errno set.
+ */
+int ringbufReaderPoll(struct ringbuf_reader *reader, int timeout) {
+  struct epoll_event event;
+  if (epoll_wait(reader->epollFd, &event, 1, timeout) < 0 && errno != EINTR) {
+    return -1;
+  }
+  ringbufReaderConsume(reader);
+  return 0;
+}
+
 int opt_timestamp = 0;
 int opt_failed = 0;
-int opt_pid = -1;
-int opt_tid = -1;
+// The -p and -t arguments, which are only resolved to IDs in main().
+char *opt_pids[MAX_ID_ARGS];
+int opt_num_pids = 0;
+char *opt_tids[MAX_ID_ARGS];
+int opt_num_tids = 0;
+char *opt_pin_pids = NULL;
+char *opt_cgroups[MAX_CGROUPS];
+int opt_num_cgroups = 0;
 int opt_duration = -1;
 char *opt_name = NULL;
+char *opt_comms[MAX_COMMS];
+int opt_num_comms = 0;
+char *opt_prefixes[MAX_PREFIXES];
+int opt_num_prefixes = 0;
+int opt_ringbuf = 0;
+int opt_threads = 0;
+int opt_wakeup_events = 0;
+int opt_wakeup_bytes = 0;
+int opt_max_latency = -1;
+int opt_adaptive = 0;
+// One of enum output_flush_policy, or -1 to pick one based on whether stdout
+// is a terminal.
+int opt_flush = -1;
+char *opt_write = NULL;
+char *opt_read = NULL;
+int opt_start = -1;
+int opt_end = -1;
+int opt_aggregate = -1;
+int opt_latency = -1;
+int opt_per_comm = 0;
+int opt_sample = 1;
+int opt_max_inflight = DEFAULT_MAX_INFLIGHT;
+int opt_long_paths = 0;
+int opt_dedup = -1;
+struct filter *opt_filter = NULL;
+
+// How the open syscalls are traced (--attach).
+enum attach_mode {
+  // fexit if the kernel and the command line allow it, kprobe otherwise.
+  ATTACH_AUTO,
+  // kprobe and kretprobe on do_sys_open().
+  ATTACH_KPROBE,
+  // The syscalls:sys_enter_* and syscalls:sys_exit_* tracepoints of every
+  // open syscall, which are a stable ABI and cheaper to hit than kprobes.
+  ATTACH_TRACEPOINT,
+  // A single fexit program on do_sys_openat2(), which sees the filename and
+  // the return value at once, so no state is kept between two probes.
+  ATTACH_FEXIT,
+};
+enum attach_mode opt_attach = ATTACH_AUTO;
+// The --attach-to arguments, each a comma-separated list of the kernel
+// functions or open syscalls to attach to instead of the default ones.
+char *opt_attach_to[MAX_ATTACH_POINTS];
+int opt_num_attach_to = 0;
+int opt_entry_only = 0;
+
+// Where trace_entry keeps what trace_return needs until the open returns
+// (--entry-state).
+enum entry_state {
+  // Task storage if the kernel supports it, a hash otherwise.
+  ENTRY_STATE_AUTO,
+  // An LRU hash keyed by pid_tgid, which holds up to --max-inflight opens.
+  ENTRY_STATE_HASH,
+  // Task local storage (Linux 5.11), a slot that hangs off the task itself,
+  // so there is no key to hash and nothing to evict.
+  ENTRY_STATE_TASK,
+};
+enum entry_state opt_entry_state = ENTRY_STATE_AUTO;
+
+// Values for options that only have a long form. These start after the range
+// of characters so they cannot collide with a short option.
+enum {
+  OPT_RINGBUF = 256,
+  OPT_THREADS,
+  OPT_WAKEUP_EVENTS,
+  OPT_WAKEUP_BYTES,
+  OPT_MAX_LATENCY,
+  OPT_ADAPTIVE,
+  OPT_FLUSH,
+  OPT_START,
+  OPT_END,
+  OPT_COMM,
+  OPT_AGGREGATE,
+  OPT_LATENCY,
+  OPT_PER_COMM,
+  OPT_SAMPLE,
+  OPT_MAX_INFLIGHT,
+  OPT_LONG_PATHS,
+  OPT_PIN_PIDS,
+  OPT_CGROUP,
+  OPT_PREFIX,
+  OPT_DEDUP,
+  OPT_ATTACH,
+  OPT_ATTACH_TO,
+  OPT_ENTRY_ONLY,
+  OPT_ENTRY_STATE,
+  OPT_FILTER,
+};
 
 void usage(FILE *fd) {
   fprintf(
       fd,
-      "usage: opensnoop.py [-h] [-T] [-x] [-p PID] [-t TID] [-d DURATION] [-n "
-      "NAME]\n"
+      "usage: opensnoop [-h] [-T] [-x] [-p PID] [-t TID] [-d DURATION]\n"
+      "                 [-n NAME] [--pin-pids PATH] [--cgroup PATH]\n"
+      "                 [--comm NAME] [--prefix PATH] [--sample N]\n"
+      "                 [--aggregate INTERVAL]\n"
+      "                 [--latency INTERVAL [--per-comm]] [--max-inflight N]\n"
+      "                 [--ringbuf] [--threads THREADS]\n"
+      "                 [--wakeup-events N | --wakeup-bytes BYTES]\n"
+      "                 [--max-latency MS] [--adaptive]\n"
+      "                 [--flush {line,batch,full}] [--long-paths]\n"
+      "                 [--dedup MS] [--filter EXPR]\n"
+      "                 [--attach {auto,kprobe,tracepoint,fexit}]\n"
+      "                 [--attach-to NAME] [--entry-only]\n"
+      "                 [--entry-state {auto,hash,task}]\n"
+      "                 [-w FILE | -r FILE [--start SECONDS] [--end SECONDS]]\n"
       "\n"
       "Trace open() syscalls\n"
       "\n"
@@ -134,11 +600,110 @@ void usage(FILE *fd) {
       "  -h, --help            show this help message and exit\n"
       "  -T, --timestamp       include timestamp on output\n"
       "  -x, --failed          only show failed opens\n"
-      "  -p PID, --pid PID     trace this PID only\n"
-      "  -t TID, --tid TID     trace this TID only\n"
+      "  -p PID, --pid PID     trace these PIDs only: a comma-separated list,\n"
+      "                        or the directory of a cgroup whose processes\n"
+      "                        to trace (can be repeated)\n"
+      "  -t TID, --tid TID     trace these TIDs only, like -p but with the\n"
+      "                        threads of a cgroup\n"
+      "  --pin-pids PATH       pin the set of PIDs or TIDs from -p or -t to\n"
+      "                        PATH in a BPF filesystem, where it can be\n"
+      "                        updated while tracing (for example with\n"
+      "                        bpftool)\n"
+      "  --cgroup PATH         only trace processes that are directly in the\n"
+      "                        cgroup v2 directory PATH, which is checked in\n"
+      "                        the kernel (can be repeated)\n"
       "  -d DURATION, --duration DURATION\n"
       "                        total duration of trace in seconds\n"
       "  -n NAME, --name NAME  only print process names containing this name\n"
+      "  --comm NAME           only trace processes named NAME, or whose name\n"
+      "                        starts with NAME if it ends with '*' (can be\n"
+      "                        repeated, and unlike -n, is applied in the\n"
+      "                        kernel)\n"
+      "  --prefix PATH         only trace opens of filenames that start with\n"
+      "                        PATH, as passed to open() (can be repeated,\n"
+      "                        and is applied in the kernel)\n"
+      "  --sample N            only trace a random 1 in N opens (the rate is\n"
+      "                        printed before the output so counts can be\n"
+      "                        scaled back up)\n"
+      "  --aggregate INTERVAL  count opens per process name, path, and errno\n"
+      "                        in the kernel and print the counts every\n"
+      "                        INTERVAL seconds instead of every event\n"
+      "  --latency INTERVAL    keep a histogram of how long opens take in the\n"
+      "                        kernel and print it every INTERVAL seconds\n"
+      "                        instead of every event\n"
+      "  --per-comm            with --latency, print a histogram per process\n"
+      "                        name\n"
+      "  --max-inflight N      keep track of up to N opens that have started\n"
+      "                        but not returned, evicting the oldest ones\n"
+      "                        beyond that, with --entry-state hash\n"
+      "                        (default: 10240)\n"
+      "  --ringbuf             deliver events through one BPF ring buffer\n"
+      "                        shared by all CPUs instead of per-CPU perf\n"
+      "                        buffers (requires Linux 5.8)\n"
+      "  --threads THREADS     drain the per-CPU perf buffers from this many\n"
+      "                        threads, each pinned to the CPUs whose buffers\n"
+      "                        it owns (output is not ordered across threads)\n"
+      "  --wakeup-events N     only wake the consumer up once N events are\n"
+      "                        waiting in a buffer\n"
+      "  --wakeup-bytes BYTES  only wake the consumer up once BYTES bytes are\n"
+      "                        waiting in a buffer\n"
+      "  --max-latency MS      with batched wakeups, drain the buffers at\n"
+      "                        least every MS milliseconds (default: 100)\n"
+      "  --adaptive            grow the perf buffer of a CPU that is losing\n"
+      "                        events and shrink the buffers of idle CPUs\n"
+      "  --flush {line,batch,full}\n"
+      "                        when to write buffered output: after every\n"
+      "                        line, after every batch of events, or only\n"
+      "                        when the buffer is full (default: batch if\n"
+      "                        stdout is a terminal and there is no -w,\n"
+      "                        full otherwise)\n"
+      "  --long-paths          capture up to PATH_MAX bytes of each filename\n"
+      "                        instead of NAME_MAX\n"
+      "  --dedup MS            only send the first open of a path by a\n"
+      "                        process in every MS milliseconds, along with\n"
+      "                        how many opens were dropped since the last one\n"
+      "                        (DUPS)\n"
+      "  --filter EXPR         only trace opens for which EXPR is true, where\n"
+      "                        EXPR compares pid, tid, uid, gid, comm, or\n"
+      "                        ret with ==, !=, <, <=, >, >=, ^= (starts\n"
+      "                        with), or in {...}, and combines those with\n"
+      "                        &&, ||, !, and parentheses (is compiled into\n"
+      "                        the BPF programs)\n"
+      "  --attach {auto,kprobe,tracepoint,fexit}\n"
+      "                        trace opens with a kprobe on do_sys_open(),\n"
+      "                        with the open syscall tracepoints, or with one\n"
+      "                        fexit program, which needs kernel BTF and has\n"
+      "                        the least overhead (default: auto, which is\n"
+      "                        fexit where it works and kprobe otherwise)\n"
+      "  --attach-to NAME      attach to these entry points instead of the\n"
+      "                        default ones: a comma-separated list of\n"
+      "                        kernel functions, written FUNC:N if the\n"
+      "                        filename is not their second argument, or of\n"
+      "                        open syscalls with --attach tracepoint (can\n"
+      "                        be repeated, and adds an ORIGIN column when\n"
+      "                        there is more than one)\n"
+      "  --entry-only          send each event from where the open starts,\n"
+      "                        without its FD or ERR, which halves what\n"
+      "                        tracing costs every open (cannot be combined\n"
+      "                        with -x or the options that --attach fexit\n"
+      "                        does not support)\n"
+      "  --entry-state {auto,hash,task}\n"
+      "                        keep each open between where it starts and\n"
+      "                        where it returns in a hash of up to\n"
+      "                        --max-inflight opens, or in storage attached\n"
+      "                        to the task, which is cheaper and never fills\n"
+      "                        up (default: auto, which is task where the\n"
+      "                        kernel supports it and hash otherwise)\n"
+      "  -w FILE, --write FILE\n"
+      "                        write events to a binary capture file instead\n"
+      "                        of printing them\n"
+      "  -r FILE, --read FILE  print the events in a capture file written\n"
+      "                        with -w instead of tracing (-T, -x, and -n\n"
+      "                        apply)\n"
+      "  --start SECONDS       with -r, skip events before this many seconds\n"
+      "                        after the first event of the capture\n"
+      "  --end SECONDS         with -r, skip events after this many seconds\n"
+      "                        after the first event of the capture\n"
       "\n"
       "examples:\n"
       "    ./opensnoop           # trace all open() syscalls\n"
@@ -146,9 +711,46 @@ void usage(FILE *fd) {
       "    ./opensnoop -x        # only show failed opens\n"
       "    ./opensnoop -p 181    # only trace PID 181\n"
       "    ./opensnoop -t 123    # only trace TID 123\n"
+      "    ./opensnoop -p 181,182 -p /sys/fs/cgroup/workers # several PIDs\n"
+      "    ./opensnoop --cgroup /sys/fs/cgroup/system.slice/foo.service\n"
       "    ./opensnoop -d 10     # trace for 10 seconds only\n"
       "    ./opensnoop -n main   # only print process names containing "
-      "\"main\"\n");
+      "\"main\"\n"
+      "    ./opensnoop --ringbuf # use a shared ring buffer for events\n"
+      "    ./opensnoop --threads 4 # drain perf buffers from 4 threads\n"
+      "    ./opensnoop --wakeup-events 64 --max-latency 50 # batch wakeups\n"
+      "    ./opensnoop --flush line | grep foo # do not hold back output\n"
+      "    ./opensnoop -w opens.cap  # save events to opens.cap\n"
+      "    ./opensnoop -r opens.cap --start 60 --end 120 # second minute\n"
+      "    ./opensnoop --comm bash --comm 'kworker/*' # bash and kworkers\n"
+      "    ./opensnoop --prefix /var/lib/foo/ # who is hammering /var/lib/foo\n"
+      "    ./opensnoop --sample 100 --aggregate 10 # 1%% of opens, every 10s\n"
+      "    ./opensnoop --aggregate 10 # who opens what, every 10 seconds\n"
+      "    ./opensnoop --dedup 1000 # at most one line per second per file\n"
+      "    ./opensnoop --filter 'uid != 0 && comm ^= \"java\"' # not root\n"
+      "    ./opensnoop --attach tracepoint # trace with less overhead\n"
+      "    ./opensnoop --attach fexit # fail instead of using kprobes\n"
+      "    ./opensnoop --attach tracepoint --attach-to openat,openat2 # both\n"
+      "    ./opensnoop --entry-only # only who opens what, more cheaply\n"
+      "    ./opensnoop --entry-state hash --max-inflight 100000 # pre-5.11\n"
+      "    ./opensnoop --latency 5 --per-comm # how slow opens are, by name\n");
+}
+
+/**
+ * Whether events are sent to userspace, as opposed to only being counted in
+ * the kernel for --aggregate or --latency.
+ */
+int sendsEvents() { return opt_aggregate == -1 && opt_latency == -1; }
+
+/**
+ * Whether trace_exit can do what the command line asks for, either with
+ * --attach fexit or with --entry-only: it has no variants for the filters,
+ * --dedup, or the in-kernel summaries.
+ */
+int traceExitSupportsOptions() {
+  return sendsEvents() && opt_num_pids == 0 && opt_num_tids == 0 &&
+         opt_num_cgroups == 0 && opt_num_comms == 0 && opt_sample == 1 &&
+         opt_num_prefixes == 0 && opt_dedup == -1;
 }
 
 void parseArgs(int argc, char **argv) {
@@ -163,9 +765,36 @@ void parseArgs(int argc, char **argv) {
         {"tid", required_argument, 0, 't'},
         {"duration", required_argument, 0, 'd'},
         {"name", required_argument, 0, 'n'},
+        {"ringbuf", no_argument, 0, OPT_RINGBUF},
+        {"threads", required_argument, 0, OPT_THREADS},
+        {"wakeup-events", required_argument, 0, OPT_WAKEUP_EVENTS},
+        {"wakeup-bytes", required_argument, 0, OPT_WAKEUP_BYTES},
+        {"max-latency", required_argument, 0, OPT_MAX_LATENCY},
+        {"adaptive", no_argument, 0, OPT_ADAPTIVE},
+        {"flush", required_argument, 0, OPT_FLUSH},
+        {"write", required_argument, 0, 'w'},
+        {"read", required_argument, 0, 'r'},
+        {"start", required_argument, 0, OPT_START},
+        {"end", required_argument, 0, OPT_END},
+        {"comm", required_argument, 0, OPT_COMM},
+        {"aggregate", required_argument, 0, OPT_AGGREGATE},
+        {"latency", required_argument, 0, OPT_LATENCY},
+        {"per-comm", no_argument, 0, OPT_PER_COMM},
+        {"sample", required_argument, 0, OPT_SAMPLE},
+        {"max-inflight", required_argument, 0, OPT_MAX_INFLIGHT},
+        {"long-paths", no_argument, 0, OPT_LONG_PATHS},
+        {"pin-pids", required_argument, 0, OPT_PIN_PIDS},
+        {"cgroup", required_argument, 0, OPT_CGROUP},
+        {"prefix", required_argument, 0, OPT_PREFIX},
+        {"dedup", required_argument, 0, OPT_DEDUP},
+        {"attach", required_argument, 0, OPT_ATTACH},
+        {"attach-to", required_argument, 0, OPT_ATTACH_TO},
+        {"entry-only", no_argument, 0, OPT_ENTRY_ONLY},
+        {"entry-state", required_argument, 0, OPT_ENTRY_STATE},
+        {"filter", required_argument, 0, OPT_FILTER},
         {0, 0, 0, 0}};
     int option_index = 0;
-    c = getopt_long(argc, argv, "hTxp:t:d:n:", long_options, &option_index);
+    c = getopt_long(argc, argv, "hTxp:t:d:n:w:r:", long_options, &option_index);
     if (c == -1) {
       break;
     }
@@ -184,19 +813,34 @@ void parseArgs(int argc, char **argv) {
       break;
 
     case 'p':
-      opt_pid = parseNonNegativeInteger(optarg);
-      if (opt_pid == -1) {
-        fprintf(stderr, "Invalid value for -p: '%s'\n", optarg);
+    case 't': {
+      // Cgroup paths are only read once the pids map exists.
+      if (optarg[0] != '/' && parseIdList(optarg, /* mapFd */ -1) < 0) {
+        fprintf(stderr, "Invalid value for -%c: '%s'\n", c, optarg);
+        exit(1);
+      }
+      char **args = c == 'p' ? opt_pids : opt_tids;
+      int *numArgs = c == 'p' ? &opt_num_pids : &opt_num_tids;
+      if (*numArgs == MAX_ID_ARGS) {
+        fprintf(stderr, "-%c cannot be given more than %d times\n", c,
+                MAX_ID_ARGS);
         exit(1);
       }
+      args[(*numArgs)++] = optarg;
+      break;
+    }
+
+    case OPT_PIN_PIDS:
+      opt_pin_pids = optarg;
       break;
 
-    case 't':
-      opt_tid = parseNonNegativeInteger(optarg);
-      if (opt_tid == -1) {
-        fprintf(stderr, "Invalid value for -t: '%s'\n", optarg);
+    case OPT_CGROUP:
+      if (opt_num_cgroups == MAX_CGROUPS) {
+        fprintf(stderr, "--cgroup cannot be given more than %d times\n",
+                MAX_CGROUPS);
         exit(1);
       }
+      opt_cgroups[opt_num_cgroups++] = optarg;
       break;
 
     case 'd':
@@ -217,6 +861,230 @@ void parseArgs(int argc, char **argv) {
       strcpy(opt_name, optarg);
       break;
 
+    case OPT_COMM: {
+      // A trailing '*' only marks a prefix; it is not part of the name.
+      size_t len = strlen(optarg);
+      if (len > 0 && optarg[len - 1] == '*') {
+        len--;
+      }
+      if (len >= TASK_COMM_LEN) {
+        fprintf(stderr, "Invalid value for --comm: '%s' (names are at most %d "
+                        "characters)\n",
+                optarg, TASK_COMM_LEN - 1);
+        exit(1);
+      }
+      if (opt_num_comms == MAX_COMMS) {
+        fprintf(stderr, "--comm cannot be given more than %d times\n",
+                MAX_COMMS);
+        exit(1);
+      }
+      opt_comms[opt_num_comms++] = optarg;
+      break;
+    }
+
+    case OPT_PREFIX:
+      if (strlen(optarg) > MAX_PREFIX_LEN) {
+        fprintf(stderr, "Invalid value for --prefix: '%s' (prefixes are at "
+                        "most %d characters)\n",
+                optarg, MAX_PREFIX_LEN);
+        exit(1);
+      }
+      if (opt_num_prefixes == MAX_PREFIXES) {
+        fprintf(stderr, "--prefix cannot be given more than %d times\n",
+                MAX_PREFIXES);
+        exit(1);
+      }
+      opt_prefixes[opt_num_prefixes++] = optarg;
+      break;
+
+    case OPT_SAMPLE:
+      opt_sample = parseNonNegativeInteger(optarg);
+      if (opt_sample <= 0) {
+        fprintf(stderr, "Invalid value for --sample: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_AGGREGATE:
+      opt_aggregate = parseNonNegativeInteger(optarg);
+      if (opt_aggregate <= 0) {
+        fprintf(stderr, "Invalid value for --aggregate: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_LATENCY:
+      opt_latency = parseNonNegativeInteger(optarg);
+      if (opt_latency <= 0) {
+        fprintf(stderr, "Invalid value for --latency: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_PER_COMM:
+      opt_per_comm = 1;
+      break;
+
+    case OPT_MAX_INFLIGHT:
+      opt_max_inflight = parseNonNegativeInteger(optarg);
+      if (opt_max_inflight <= 0) {
+        fprintf(stderr, "Invalid value for --max-inflight: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_RINGBUF:
+      opt_ringbuf = 1;
+      break;
+
+    case OPT_THREADS:
+      opt_threads = parseNonNegativeInteger(optarg);
+      if (opt_threads <= 0) {
+        fprintf(stderr, "Invalid value for --threads: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_WAKEUP_EVENTS:
+      opt_wakeup_events = parseNonNegativeInteger(optarg);
+      if (opt_wakeup_events <= 0) {
+        fprintf(stderr, "Invalid value for --wakeup-events: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_WAKEUP_BYTES:
+      opt_wakeup_bytes = parseNonNegativeInteger(optarg);
+      if (opt_wakeup_bytes <= 0) {
+        fprintf(stderr, "Invalid value for --wakeup-bytes: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_MAX_LATENCY:
+      opt_max_latency = parseNonNegativeInteger(optarg);
+      if (opt_max_latency == -1) {
+        fprintf(stderr, "Invalid value for --max-latency: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_ADAPTIVE:
+      opt_adaptive = 1;
+      break;
+
+    case OPT_FLUSH:
+      if (strcmp(optarg, "line") == 0) {
+        opt_flush = OUTPUT_FLUSH_LINE;
+      } else if (strcmp(optarg, "batch") == 0) {
+        opt_flush = OUTPUT_FLUSH_BATCH;
+      } else if (strcmp(optarg, "full") == 0) {
+        opt_flush = OUTPUT_FLUSH_FULL;
+      } else {
+        fprintf(stderr, "Invalid value for --flush: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_LONG_PATHS:
+      opt_long_paths = 1;
+      break;
+
+    case OPT_DEDUP:
+      opt_dedup = parseNonNegativeInteger(optarg);
+      if (opt_dedup <= 0) {
+        fprintf(stderr, "Invalid value for --dedup: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_FILTER:
+      if (opt_filter != NULL) {
+        fprintf(stderr, "--filter cannot be given more than once, but its "
+                        "expression can use &&\n");
+        exit(1);
+      }
+      opt_filter = filterParse(optarg);
+      if (opt_filter == NULL) {
+        exit(1);
+      }
+      break;
+
+    case OPT_ATTACH:
+      if (strcmp(optarg, "auto") == 0) {
+        opt_attach = ATTACH_AUTO;
+      } else if (strcmp(optarg, "kprobe") == 0) {
+        opt_attach = ATTACH_KPROBE;
+      } else if (strcmp(optarg, "tracepoint") == 0) {
+        opt_attach = ATTACH_TRACEPOINT;
+      } else if (strcmp(optarg, "fexit") == 0) {
+        opt_attach = ATTACH_FEXIT;
+      } else {
+        fprintf(stderr, "Invalid value for --attach: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_ATTACH_TO:
+      if (opt_num_attach_to == MAX_ATTACH_POINTS) {
+        fprintf(stderr, "--attach-to cannot be given more than %d times\n",
+                MAX_ATTACH_POINTS);
+        exit(1);
+      }
+      opt_attach_to[opt_num_attach_to++] = optarg;
+      break;
+
+    case OPT_ENTRY_ONLY:
+      opt_entry_only = 1;
+      break;
+
+    case OPT_ENTRY_STATE:
+      if (strcmp(optarg, "auto") == 0) {
+        opt_entry_state = ENTRY_STATE_AUTO;
+      } else if (strcmp(optarg, "hash") == 0) {
+        opt_entry_state = ENTRY_STATE_HASH;
+      } else if (strcmp(optarg, "task") == 0) {
+        opt_entry_state = ENTRY_STATE_TASK;
+      } else {
+        fprintf(stderr, "Invalid value for --entry-state: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case 'w':
+      opt_write = optarg;
+      break;
+
+    case 'r':
+      opt_read = optarg;
+      break;
+
+    case OPT_START:
+      opt_start = parseNonNegativeInteger(optarg);
+      if (opt_start == -1) {
+        fprintf(stderr, "Invalid value for --start: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
+    case OPT_END:
+      opt_end = parseNonNegativeInteger(optarg);
+      if (opt_end == -1) {
+        fprintf(stderr, "Invalid value for --end: '%s'\n", optarg);
+        usage(stderr);
+        exit(1);
+      }
+      break;
+
     case 'h':
       usage(stdout);
       exit(0);
@@ -228,67 +1096,1402 @@ void parseArgs(int argc, char **argv) {
       break;
     }
   }
-}
 
-void printHeader() {
-  if (opt_timestamp) {
-    printf("%-14s", "TIME(s)");
+  if (opt_ringbuf && opt_threads != 0) {
+    // A ring buffer only supports a single consumer.
+    fprintf(stderr, "--threads cannot be combined with --ringbuf\n");
+    exit(1);
   }
-  printf("%-6s %-16s %4s %3s %s\n", opt_tid != -1 ? "TID" : "PID", "COMM", "FD",
-         "ERR", "PATH");
-}
 
-long long initialTimestamp = 0;
-const float NANOS_PER_SECOND = 1000000000;
-void perf_reader_raw_callback(void *cb_cookie, void *raw, int raw_size) {
-  struct data_t *event = (struct data_t *)raw;
-  if (opt_failed && event->ret >= 0) {
-    return;
+  if (opt_ringbuf && opt_adaptive) {
+    fprintf(stderr, "--adaptive cannot be combined with --ringbuf\n");
+    exit(1);
   }
 
-  if (opt_name != NULL && strstr(event->comm, opt_name) == NULL) {
-    return;
+  if (opt_wakeup_events != 0 && opt_wakeup_bytes != 0) {
+    fprintf(stderr,
+            "--wakeup-events cannot be combined with --wakeup-bytes\n");
+    exit(1);
   }
 
-  int fd_s, err;
-  if (event->ret >= 0) {
-    fd_s = event->ret;
-    err = 0;
-  } else {
-    fd_s = -1;
-    err = -event->ret;
+  // Records that have not reached the watermark do not wake the consumer up,
+  // so there must be a timer that bounds how long they wait.
+  if ((opt_wakeup_events != 0 || opt_wakeup_bytes != 0) &&
+      opt_max_latency == -1) {
+    opt_max_latency = DEFAULT_MAX_LATENCY_MS;
   }
 
-  if (opt_timestamp) {
-    if (initialTimestamp == 0) {
-      initialTimestamp = event->ts;
-    }
+  if (opt_write != NULL && opt_read != NULL) {
+    fprintf(stderr, "-w cannot be combined with -r\n");
+    exit(1);
+  }
 
-    long long delta = event->ts - initialTimestamp;
-    printf("%-14.9f", delta / NANOS_PER_SECOND);
+  if ((opt_start != -1 || opt_end != -1) && opt_read == NULL) {
+    fprintf(stderr, "--start and --end require -r\n");
+    exit(1);
   }
 
-  int pid = event->id >> 32;
-  printf("%-6d %-16s %4d %3d %s\n", pid, event->comm, fd_s, err, event->fname);
-}
+  if (opt_start != -1 && opt_end != -1 && opt_start > opt_end) {
+    fprintf(stderr, "--start must not be after --end\n");
+    exit(1);
+  }
 
-int main(int argc, char **argv) {
-  parseArgs(argc, argv);
+  // There is only one pids map, and trace_entry looks up either the PID or the
+  // TID in it.
+  if (opt_num_pids != 0 && opt_num_tids != 0) {
+    fprintf(stderr, "-p cannot be combined with -t\n");
+    exit(1);
+  }
 
-  bpf_log_buf[0] = '\0';
-  int hashMapFd = -1, eventsMapFd = -1, entryProgFd = -1, kprobeFd = -1,
-      returnProgFd, kretprobeFd;
-  struct perf_reader **readers = NULL;
-  int exitCode = 1;
-  int *cpus = NULL;
-  size_t numCpu = 0;
-  if (getOnlineCpus(&cpus, &numCpu) < 0) {
-    perror("Failure in getOnlineCpus()");
-    goto error;
+  // trace_entry checks one of them only.
+  if (opt_num_cgroups != 0 && (opt_num_pids != 0 || opt_num_tids != 0)) {
+    fprintf(stderr, "--cgroup cannot be combined with -p or -t\n");
+    exit(1);
   }
 
-  readers = malloc(numCpu * sizeof(struct perf_reader *));
-  if (readers == NULL) {
+  if (opt_pin_pids != NULL && opt_num_pids == 0 && opt_num_tids == 0) {
+    fprintf(stderr, "--pin-pids requires -p or -t\n");
+    exit(1);
+  }
+
+  // A capture records its own sampling rate.
+  if (opt_sample != 1 && opt_read != NULL) {
+    fprintf(stderr, "--sample cannot be combined with -r\n");
+    exit(1);
+  }
+
+  if (opt_aggregate != -1 && opt_latency != -1) {
+    fprintf(stderr, "--aggregate cannot be combined with --latency\n");
+    exit(1);
+  }
+
+  if (opt_per_comm && opt_latency == -1) {
+    fprintf(stderr, "--per-comm requires --latency\n");
+    exit(1);
+  }
+
+  // The latency histogram is collected without reading the filename.
+  if (opt_num_prefixes != 0 && opt_latency != -1) {
+    fprintf(stderr, "--prefix cannot be combined with --latency\n");
+    exit(1);
+  }
+
+  // There are no events to transport, buffer, or capture when they are only
+  // counted in the kernel.
+  if (!sendsEvents() &&
+      (opt_ringbuf || opt_threads != 0 || opt_wakeup_events != 0 ||
+       opt_wakeup_bytes != 0 || opt_adaptive || opt_long_paths ||
+       opt_dedup != -1 || opt_write != NULL || opt_read != NULL)) {
+    fprintf(stderr, "%s cannot be combined with --ringbuf, --threads, "
+                    "--wakeup-events, --wakeup-bytes, --adaptive, "
+                    "--long-paths, --dedup, -w, or -r\n",
+            opt_aggregate != -1 ? "--aggregate" : "--latency");
+    exit(1);
+  }
+
+  // A capture does not record most of what the filter compares, and the
+  // filter only exists as BPF instructions.
+  if (opt_filter != NULL && opt_read != NULL) {
+    fprintf(stderr, "--filter cannot be combined with -r\n");
+    exit(1);
+  }
+
+  // A capture records the attach points it was written with, and whether it
+  // has return values.
+  if ((opt_num_attach_to != 0 || opt_entry_only) && opt_read != NULL) {
+    fprintf(stderr,
+            "--attach-to and --entry-only cannot be combined with -r\n");
+    exit(1);
+  }
+
+  // trace_exit only comes in the variants that send every event.
+  if (opt_attach == ATTACH_FEXIT && opt_read == NULL &&
+      !traceExitSupportsOptions()) {
+    fprintf(stderr, "--attach fexit cannot be combined with -p, -t, "
+                    "--cgroup, --comm, --sample, --prefix, --dedup, "
+                    "--aggregate, or --latency\n");
+    exit(1);
+  }
+
+  // --entry-only attaches trace_exit where the open starts, with a kprobe or a
+  // tracepoint, so there is no return value to filter on.
+  if (opt_entry_only &&
+      (opt_failed || opt_attach == ATTACH_FEXIT ||
+       !traceExitSupportsOptions())) {
+    fprintf(stderr, "--entry-only cannot be combined with -x, --attach fexit, "
+                    "-p, -t, --cgroup, --comm, --sample, --prefix, --dedup, "
+                    "--aggregate, or --latency\n");
+    exit(1);
+  }
+  if (opt_entry_only && opt_filter != NULL && filterUsesReturn(opt_filter)) {
+    fprintf(stderr, "--filter cannot compare ret with --entry-only\n");
+    exit(1);
+  }
+
+  // Someone watching the output wants to see events as they happen, but when
+  // it goes to a file or a pipe, fewer and larger writes are what matters.
+  if (opt_flush == -1) {
+    opt_flush = opt_write == NULL && isatty(STDOUT_FILENO) ? OUTPUT_FLUSH_BATCH
+                                                           : OUTPUT_FLUSH_FULL;
+  }
+}
+
+/**
+ * How long a consumer may block waiting to be woken up for new events.
+ */
+int getPollTimeout() {
+  int timeout;
+  if (opt_max_latency != -1) {
+    timeout = opt_max_latency;
+  } else {
+    // Without a deadline, there is no reason to ever wake up without events.
+    timeout = opt_duration != -1 ? 100 : -1;
+  }
+
+  // The buffer sizes must be checked even when no events arrive, as that is
+  // how idle buffers are detected.
+  if (opt_adaptive && (timeout == -1 || timeout > ADAPTIVE_INTERVAL_MS)) {
+    timeout = ADAPTIVE_INTERVAL_MS;
+  }
+  return timeout;
+}
+
+/**
+ * Fills in the comms trie key for a --comm argument.
+ */
+void commKeyFor(const char *name, struct comm_key *key) {
+  size_t len = strlen(name);
+  memset(key, 0, sizeof(*key));
+  if (len > 0 && name[len - 1] == '*') {
+    len--;
+    key->prefixlen = len * 8;
+  } else {
+    // Include the NUL terminator so that only the whole name matches.
+    key->prefixlen = (len + 1) * 8;
+  }
+  memcpy(key->comm, name, len);
+}
+
+/**
+ * Whether comm matches one of the --comm arguments. This is only needed for
+ * -r: when tracing, the BPF program does the matching.
+ */
+int commAllowed(const char *comm) {
+  for (int i = 0; i < opt_num_comms; i++) {
+    struct comm_key key;
+    commKeyFor(opt_comms[i], &key);
+    if (strncmp(comm, key.comm, key.prefixlen / 8) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Whether the fnameLen bytes at fname start with one of the --prefix arguments.
+ * Like commAllowed(), this is only needed for -r.
+ */
+int prefixAllowed(const char *fname, size_t fnameLen) {
+  for (int i = 0; i < opt_num_prefixes; i++) {
+    size_t len = strlen(opt_prefixes[i]);
+    if (fnameLen >= len && memcmp(fname, opt_prefixes[i], len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Tells downstream tools how much to scale counts up by when only 1 in
+ * sampleRate opens were traced.
+ */
+void printSampleRate(int sampleRate) {
+  if (sampleRate > 1) {
+    printf("Sampling 1 in %d opens\n", sampleRate);
+  }
+}
+
+// The CAPTURE_FLAG_* flags that describe the events being printed: those of
+// the capture with -r, or otherwise the ones that -w would write.
+__u32 eventFlags = 0;
+
+// With CAPTURE_FLAG_ORIGIN, the names of the origins of the events being
+// printed, by index: those of the attach points, or those of the capture.
+const char *originNames[MAX_ATTACH_POINTS];
+__u32 numOrigins = 0;
+
+void printHeader(int sampleRate) {
+  printSampleRate(sampleRate);
+  if (opt_timestamp) {
+    printf("%-14s", "TIME(s)");
+  }
+  printf("%-6s %-16s ", eventFlags & CAPTURE_FLAG_TID ? "TID" : "PID", "COMM");
+  if (!(eventFlags & CAPTURE_FLAG_ENTRY_ONLY)) {
+    printf("%4s %3s ", "FD", "ERR");
+  }
+  if (eventFlags & CAPTURE_FLAG_DEDUP) {
+    printf("%5s ", "DUPS");
+  }
+  if (eventFlags & CAPTURE_FLAG_ORIGIN) {
+    printf("%-16s ", "ORIGIN");
+  }
+  printf("PATH\n");
+}
+
+/**
+ * State for one thread that drains perf buffers (or the ring buffer). Each
+ * consumer is passed as the cb_cookie for the buffers it owns, so nothing in
+ * here is shared between threads.
+ */
+struct consumer {
+  pthread_t thread;
+  // Slice of the readers array that this consumer polls.
+  struct perf_reader **readers;
+  // The bookkeeping for each of those readers.
+  struct cpu_buffer *buffers;
+  int numReaders;
+  // The CPUs whose buffers are in readers, which is also where the consumer
+  // thread is pinned.
+  cpu_set_t cpuSet;
+  // Where the perf buffers are registered for the BPF program, which is
+  // needed to swap in a resized buffer.
+  int eventsMapFd;
+  // When the buffer sizes were last checked by adaptBufferSizes().
+  struct timespec lastAdaptTime;
+  // Where the consumer formats its lines. Each consumer writes its buffer out
+  // separately, only ever whole lines, and under a lock shared by all of them
+  // (see outputFlush()), so lines from different consumers do not get torn
+  // apart even when stdout is a pipe.
+  struct output out;
+  // With -w, where the consumer collects events instead.
+  struct capture_block block;
+};
+
+/**
+ * Bookkeeping for the perf buffer of one CPU (or for the ring buffer), which
+ * is passed as the buffer's cb_cookie. Only the consumer that owns the buffer
+ * touches it.
+ */
+struct cpu_buffer {
+  int cpu;
+  int pageCnt;
+  unsigned long long numEvents;
+  unsigned long long numLost;
+  // numEvents and numLost as of the last adaptBufferSizes().
+  unsigned long long lastNumEvents;
+  unsigned long long lastNumLost;
+  // Number of adaptBufferSizes() checks in a row without any events.
+  int idleIntervals;
+  // The output of the consumer that owns the buffer.
+  struct output *out;
+  // With -w, the capture block of the consumer that owns the buffer.
+  struct capture_block *block;
+};
+
+// Set by the main thread to ask the consumer threads to return.
+int stopConsumers = 0;
+
+// The file events are written to with -w.
+struct capture *capture = NULL;
+
+long long initialTimestamp = 0;
+void perf_reader_raw_callback(void *cb_cookie, void *raw, int raw_size) {
+  struct data_t *event = (struct data_t *)raw;
+  struct cpu_buffer *buffer = (struct cpu_buffer *)cb_cookie;
+  buffer->numEvents++;
+  if (raw_size < DATA_T_HEADER_SIZE) {
+    fprintf(stderr, "Ignoring truncated event of %d bytes\n", raw_size);
+    return;
+  }
+
+  // The record ends after the NUL terminator of fname, though perf buffer
+  // records may also have some zero padding after that. Either way, fname must
+  // not be read beyond raw_size.
+  int fnameLen = strnlen(event->fname, raw_size - DATA_T_HEADER_SIZE);
+  // When tracing, the BPF program already drops successful opens for -x, but
+  // a capture read with -r may still contain them.
+  if (opt_failed && event->ret >= 0) {
+    return;
+  }
+
+  if (opt_read != NULL && opt_num_comms != 0 && !commAllowed(event->comm)) {
+    return;
+  }
+
+  if (opt_read != NULL && opt_num_prefixes != 0 &&
+      !prefixAllowed(event->fname, fnameLen)) {
+    return;
+  }
+
+  if (opt_name != NULL && strstr(event->comm, opt_name) == NULL) {
+    return;
+  }
+
+  if (capture != NULL) {
+    captureAppend(capture, buffer->block, event,
+                  DATA_T_HEADER_SIZE + fnameLen);
+    return;
+  }
+
+  int fd_s, err;
+  if (event->ret >= 0) {
+    fd_s = event->ret;
+    err = 0;
+  } else {
+    fd_s = -1;
+    err = -event->ret;
+  }
+
+  struct output *out = buffer->out;
+  outputReserve(out, OUTPUT_MAX_LINE);
+  if (opt_timestamp) {
+    // Whichever consumer sees an event first sets the initial timestamp.
+    long long expected = 0;
+    __atomic_compare_exchange_n(&initialTimestamp, &expected, event->ts,
+                                /* weak */ 0, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+
+    long long delta =
+        event->ts - __atomic_load_n(&initialTimestamp, __ATOMIC_RELAXED);
+    // Seconds with 9 decimals, i.e. delta in nanoseconds.
+    outputAppendFixed(out, delta, 9, -14);
+  }
+
+  // Equivalent to "%-6d %-16s %4d %3d %s\n". id is the pid_tgid, whose lower
+  // half is the TID that the header promises with -t.
+  outputAppendInt(out,
+                  eventFlags & CAPTURE_FLAG_TID ? (__u32)event->id
+                                                : event->id >> 32,
+                  -6);
+  outputAppendChar(out, ' ');
+  outputAppendString(out, event->comm, strnlen(event->comm, TASK_COMM_LEN),
+                     -16);
+  outputAppendChar(out, ' ');
+  if (!(eventFlags & CAPTURE_FLAG_ENTRY_ONLY)) {
+    outputAppendInt(out, fd_s, 4);
+    outputAppendChar(out, ' ');
+    outputAppendInt(out, err, 3);
+    outputAppendChar(out, ' ');
+  }
+  if (eventFlags & CAPTURE_FLAG_DEDUP) {
+    outputAppendInt(out, event->repeats, 5);
+    outputAppendChar(out, ' ');
+  }
+  if (eventFlags & CAPTURE_FLAG_ORIGIN) {
+    const char *origin =
+        event->origin < numOrigins ? originNames[event->origin] : "?";
+    outputAppendString(out, origin, strlen(origin), -16);
+    outputAppendChar(out, ' ');
+  }
+  outputAppendString(out, event->fname, fnameLen, 0);
+  outputEndLine(out);
+}
+
+void perf_reader_lost_callback(void *cb_cookie, unsigned long long lost) {
+  struct cpu_buffer *buffer = (struct cpu_buffer *)cb_cookie;
+  buffer->numLost += lost;
+  fprintf(stderr, "Possibly lost %llu samples on CPU %d\n", lost, buffer->cpu);
+}
+
+/**
+ * Opens the perf buffer described by buffer with the wakeup policy from the
+ * command line.
+ */
+struct perf_reader *openCpuBuffer(struct cpu_buffer *buffer) {
+  return openPerfBuffer(
+      &perf_reader_raw_callback, &perf_reader_lost_callback,
+      /* cb_cookie */ buffer, buffer->cpu, buffer->pageCnt,
+      /* wakeupEvents */ opt_wakeup_events != 0 ? opt_wakeup_events : 1,
+      /* wakeupBytes */ opt_wakeup_bytes);
+}
+
+/**
+ * Replaces the perf buffer in *reader with one of pageCnt pages. The BPF
+ * program switches to the new buffer as soon as the events map is updated,
+ * and whatever was already in the old buffer is still delivered.
+ */
+int resizeCpuBuffer(struct cpu_buffer *buffer, struct perf_reader **reader,
+                    int eventsMapFd, int pageCnt) {
+  int oldPageCnt = buffer->pageCnt;
+  buffer->pageCnt = pageCnt;
+  struct perf_reader *newReader = openCpuBuffer(buffer);
+  if (newReader == NULL) {
+    buffer->pageCnt = oldPageCnt;
+    return -1;
+  }
+
+  int perfReaderFd = perf_reader_fd(newReader);
+  if (bpf_update_elem(eventsMapFd, &buffer->cpu, &perfReaderFd, BPF_ANY) < 0) {
+    perf_reader_free(newReader);
+    buffer->pageCnt = oldPageCnt;
+    return -1;
+  }
+
+  perf_reader_event_read(*reader);
+  perf_reader_free(*reader);
+  *reader = newReader;
+  return 0;
+}
+
+/**
+ * Implements --adaptive: at most once per ADAPTIVE_INTERVAL_MS, grows the
+ * buffers of the consumer's CPUs that are losing events and shrinks the ones
+ * that have been idle.
+ */
+void adaptBufferSizes(struct consumer *consumer) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  long long elapsedMs =
+      (now.tv_sec - consumer->lastAdaptTime.tv_sec) * 1000 +
+      (now.tv_nsec - consumer->lastAdaptTime.tv_nsec) / 1000000;
+  if (elapsedMs < ADAPTIVE_INTERVAL_MS) {
+    return;
+  }
+  consumer->lastAdaptTime = now;
+
+  for (int i = 0; i < consumer->numReaders; i++) {
+    struct cpu_buffer *buffer = &consumer->buffers[i];
+    unsigned long long events = buffer->numEvents - buffer->lastNumEvents;
+    unsigned long long lost = buffer->numLost - buffer->lastNumLost;
+    buffer->lastNumEvents = buffer->numEvents;
+    buffer->lastNumLost = buffer->numLost;
+    if (events == 0 && lost == 0) {
+      buffer->idleIntervals++;
+    } else {
+      buffer->idleIntervals = 0;
+    }
+
+    int pageCnt = buffer->pageCnt;
+    if (lost > (events + lost) * ADAPTIVE_LOSS_THRESHOLD &&
+        pageCnt < ADAPTIVE_MAX_PAGE_CNT) {
+      pageCnt *= 2;
+    } else if (buffer->idleIntervals >= ADAPTIVE_IDLE_INTERVALS &&
+               pageCnt > ADAPTIVE_MIN_PAGE_CNT) {
+      pageCnt /= 2;
+      buffer->idleIntervals = 0;
+    } else {
+      continue;
+    }
+
+    if (resizeCpuBuffer(buffer, &consumer->readers[i], consumer->eventsMapFd,
+                        pageCnt) < 0) {
+      // Keep using the current buffer.
+      fprintf(stderr, "Error resizing the perf buffer for CPU %d: %s\n",
+              buffer->cpu, strerror(errno));
+    }
+  }
+}
+
+/**
+ * Called after each batch of events so that the consumer's output is flushed
+ * according to --flush.
+ */
+void endBatch(struct consumer *consumer) {
+  if (capture != NULL) {
+    captureEndBatch(capture, &consumer->block);
+  } else {
+    outputEndBatch(&consumer->out);
+  }
+}
+
+/**
+ * Waits for events on the consumer's perf buffers and processes them.
+ */
+void consumePerfBuffers(struct consumer *consumer) {
+  int rc = perf_reader_poll(consumer->numReaders, consumer->readers,
+                            getPollTimeout());
+  if (rc != 0) {
+    fprintf(stderr, "Unexpected return value from perf_reader_poll(): %d\n.",
+            rc);
+  }
+
+  // Either a buffer reached its watermark or the timer expired: in both
+  // cases, drain everything in one pass rather than waiting for each
+  // buffer's own wakeup.
+  if (opt_max_latency != -1) {
+    drainPerfBuffers(consumer->numReaders, consumer->readers);
+  }
+  endBatch(consumer);
+
+  if (opt_adaptive) {
+    adaptBufferSizes(consumer);
+  }
+}
+
+/**
+ * Body of each --threads consumer: pins itself to the CPUs whose perf buffers
+ * it owns and drains them until stopConsumers is set.
+ */
+void *consumerThread(void *arg) {
+  struct consumer *consumer = (struct consumer *)arg;
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                  &consumer->cpuSet);
+  if (rc != 0) {
+    // Not fatal: the buffers still get drained, just not CPU-locally.
+    fprintf(stderr, "Error calling pthread_setaffinity_np(): %s\n",
+            strerror(rc));
+  }
+
+  while (!__atomic_load_n(&stopConsumers, __ATOMIC_RELAXED)) {
+    consumePerfBuffers(consumer);
+  }
+
+  return NULL;
+}
+
+/**
+ * One count read from the aggregates map.
+ */
+struct aggregate {
+  struct aggregate_key key;
+  unsigned long long count;
+};
+
+/**
+ * Sorts aggregates by decreasing count.
+ */
+int compareAggregates(const void *a, const void *b) {
+  unsigned long long countA = ((const struct aggregate *)a)->count;
+  unsigned long long countB = ((const struct aggregate *)b)->count;
+  return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+/**
+ * Reads and deletes the count for key. BPF_MAP_LOOKUP_AND_DELETE_ELEM only
+ * supports hash maps as of Linux 5.14, so older kernels fall back to a lookup
+ * followed by a delete, which loses any increment in between. Fails with
+ * ENOENT if the key is gone.
+ */
+int lookupAndDeleteCount(int mapFd, void *key, unsigned long long *count) {
+  if (bpf_lookup_and_delete(mapFd, key, count) == 0) {
+    return 0;
+  }
+  if (errno == ENOENT || bpf_lookup_elem(mapFd, key, count) < 0) {
+    return -1;
+  }
+  if (bpf_delete_elem(mapFd, key) < 0 && errno != ENOENT) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Empties the counts in mapFd into entries, an array of up to maxEntries
+ * structs of entrySize bytes that start with the key and have the count at
+ * countOffset. Returns the number of entries, or -1 with errno set.
+ */
+int drainCounts(int mapFd, void *entries, size_t entrySize,
+                size_t countOffset, int maxEntries) {
+  // Taking the first key until there are none left empties the map. Opens
+  // that are counted in the meantime end up in this dump or the next one.
+  int numEntries = 0;
+  while (numEntries < maxEntries) {
+    char *entry = (char *)entries + numEntries * entrySize;
+    if (bpf_get_next_key(mapFd, /* key */ NULL, entry) < 0) {
+      if (errno == ENOENT) {
+        break;
+      }
+      return -1;
+    }
+    if (lookupAndDeleteCount(mapFd, entry,
+                             (unsigned long long *)(entry + countOffset)) <
+        0) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      return -1;
+    }
+    numEntries++;
+  }
+  return numEntries;
+}
+
+/**
+ * Prints the time at the start of each --aggregate or --latency interval.
+ */
+void printIntervalTime() {
+  char timeStr[16];
+  time_t now = time(NULL);
+  strftime(timeStr, sizeof(timeStr), "%H:%M:%S", localtime(&now));
+  printf("\n%s\n", timeStr);
+  printSampleRate(opt_sample);
+}
+
+/**
+ * Prints the counts in the aggregates map, busiest first, and resets them.
+ */
+int dumpAggregates(int mapFd) {
+  struct aggregate *aggregates =
+      malloc(MAX_AGGREGATES * sizeof(struct aggregate));
+  if (aggregates == NULL) {
+    return -1;
+  }
+  int numAggregates =
+      drainCounts(mapFd, aggregates, sizeof(struct aggregate),
+                  __builtin_offsetof(struct aggregate, count), MAX_AGGREGATES);
+  if (numAggregates < 0) {
+    free(aggregates);
+    return -1;
+  }
+  qsort(aggregates, numAggregates, sizeof(struct aggregate),
+        &compareAggregates);
+
+  printIntervalTime();
+  printf("%-8s %3s %-16s %s\n", "COUNT", "ERR", "COMM", "PATH");
+  for (int i = 0; i < numAggregates; i++) {
+    struct aggregate *aggregate = &aggregates[i];
+    // -n still applies, but since all processes are counted in the kernel,
+    // --comm is the cheaper way to narrow them down.
+    if (opt_name != NULL && strstr(aggregate->key.comm, opt_name) == NULL) {
+      continue;
+    }
+    printf("%-8llu %3d %-16.*s %.*s\n", aggregate->count, aggregate->key.err,
+           TASK_COMM_LEN, aggregate->key.comm, NAME_MAX, aggregate->key.fname);
+  }
+  fflush(stdout);
+  free(aggregates);
+  return 0;
+}
+
+/**
+ * One count read from the latency histogram.
+ */
+struct latency_count {
+  struct latency_key key;
+  unsigned long long count;
+};
+
+/**
+ * Sorts latency counts by comm.
+ */
+int compareLatencyCounts(const void *a, const void *b) {
+  return strncmp(((const struct latency_count *)a)->key.comm,
+                 ((const struct latency_count *)b)->key.comm, TASK_COMM_LEN);
+}
+
+/**
+ * Prints a log2 histogram like print_log2_hist() in bcc/table.py, where
+ * slots[i] counts values in [2^(i - 1), 2^i).
+ */
+void printLog2Hist(const unsigned long long *slots, const char *valType) {
+  static const char stars[] = "****************************************";
+  int maxSlot = 0;
+  unsigned long long maxCount = 0;
+  for (int i = 0; i < MAX_LATENCY_SLOTS; i++) {
+    if (slots[i] != 0) {
+      maxSlot = i;
+    }
+    if (slots[i] > maxCount) {
+      maxCount = slots[i];
+    }
+  }
+  if (maxSlot == 0) {
+    return;
+  }
+
+  // Wider ranges leave less room for the stars.
+  int wide = maxSlot > 32;
+  int starsMax = wide ? 20 : 40;
+  if (wide) {
+    printf("               %-29s : count     distribution\n", valType);
+  } else {
+    printf("     %-19s : count     distribution\n", valType);
+  }
+  for (int i = 1; i <= maxSlot; i++) {
+    unsigned long long low = (1ULL << i) >> 1;
+    unsigned long long high = (1ULL << i) - 1;
+    if (low == high) {
+      low--;
+    }
+    int numStars = slots[i] * starsMax / maxCount;
+    printf(wide ? "%20llu -> %-20llu : %-8llu |%-*.*s|\n"
+                : "%10llu -> %-10llu : %-8llu |%-*.*s|\n",
+           low, high, slots[i], starsMax, numStars, stars);
+  }
+}
+
+/**
+ * Prints the latency histogram (one per comm with --per-comm) and resets it.
+ */
+int dumpLatency(int mapFd) {
+  struct latency_count *counts =
+      malloc(MAX_LATENCY_KEYS * sizeof(struct latency_count));
+  if (counts == NULL) {
+    return -1;
+  }
+  int numCounts =
+      drainCounts(mapFd, counts, sizeof(struct latency_count),
+                  __builtin_offsetof(struct latency_count, count),
+                  MAX_LATENCY_KEYS);
+  if (numCounts < 0) {
+    free(counts);
+    return -1;
+  }
+  qsort(counts, numCounts, sizeof(struct latency_count),
+        &compareLatencyCounts);
+
+  printIntervalTime();
+  unsigned long long slots[MAX_LATENCY_SLOTS] = {0};
+  for (int i = 0; i < numCounts; i++) {
+    struct latency_count *count = &counts[i];
+    if ((opt_name == NULL || strstr(count->key.comm, opt_name) != NULL) &&
+        count->key.slot < MAX_LATENCY_SLOTS) {
+      slots[count->key.slot] += count->count;
+    }
+
+    // The counts are sorted by comm, so this is the end of one histogram.
+    if (opt_per_comm &&
+        (i == numCounts - 1 ||
+         compareLatencyCounts(count, &counts[i + 1]) != 0)) {
+      int hasCounts = 0;
+      for (int slot = 0; slot < MAX_LATENCY_SLOTS; slot++) {
+        hasCounts |= slots[slot] != 0;
+      }
+      if (hasCounts) {
+        printf("\ncomm = %.*s\n", TASK_COMM_LEN, count->key.comm);
+        printLog2Hist(slots, "usecs");
+      }
+      memset(slots, 0, sizeof(slots));
+    }
+  }
+  if (!opt_per_comm) {
+    printLog2Hist(slots, "usecs");
+  }
+  fflush(stdout);
+  free(counts);
+  return 0;
+}
+
+/**
+ * Implements --aggregate and --latency: calls dump every interval seconds, up
+ * to endTime if it is not NULL.
+ */
+int runIntervals(int mapFd, int interval, const struct timespec *endTime,
+                 int (*dump)(int mapFd)) {
+  // (clock_nanosleep() does not accept CLOCK_MONOTONIC_COARSE, which endTime
+  // is based on, but it shares its epoch with CLOCK_MONOTONIC.)
+  struct timespec wakeTime;
+  clock_gettime(CLOCK_MONOTONIC, &wakeTime);
+  int done = 0;
+  while (!done) {
+    wakeTime.tv_sec += interval;
+    if (endTime != NULL &&
+        (wakeTime.tv_sec > endTime->tv_sec ||
+         (wakeTime.tv_sec == endTime->tv_sec &&
+          wakeTime.tv_nsec >= endTime->tv_nsec))) {
+      wakeTime = *endTime;
+      done = 1;
+    }
+
+    int rc;
+    do {
+      rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeTime,
+                           /* remain */ NULL);
+    } while (rc == EINTR);
+
+    if (dump(mapFd) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Implements -r: prints the events in the capture file, like they would have
+ * been printed when they were traced.
+ */
+int replayCapture() {
+  struct capture_reader *reader = captureReaderOpen(opt_read);
+  if (reader == NULL) {
+    fprintf(stderr, "Error reading capture file %s: %s\n", opt_read,
+            strerror(errno));
+    return 1;
+  }
+
+  struct output out;
+  if (outputInit(&out, STDOUT_FILENO, opt_flush, OUTPUT_BUFFER_SIZE) < 0) {
+    perror("Error allocating the output buffer");
+    captureReaderFree(reader);
+    return 1;
+  }
+  struct cpu_buffer buffer = {.cpu = -1, .out = &out};
+
+  // -T, --start, and --end are all relative to the first event in the
+  // capture, which may not be the first one printed.
+  initialTimestamp = reader->firstTs;
+  __u64 startTs = reader->firstTs;
+  if (opt_start != -1) {
+    startTs += opt_start * 1000000000ULL;
+  }
+  __u64 endTs = ULLONG_MAX;
+  if (opt_end != -1) {
+    endTs = reader->firstTs + opt_end * 1000000000ULL;
+  }
+
+  eventFlags = reader->flags;
+  for (__u32 i = 0; i < reader->numOrigins; i++) {
+    originNames[i] = reader->origins[i].name;
+  }
+  numOrigins = reader->numOrigins;
+  printHeader(reader->sampleRate);
+  fflush(stdout);
+  int rc = captureReaderReplay(reader, startTs, endTs,
+                               &perf_reader_raw_callback, &buffer);
+  if (rc < 0) {
+    fprintf(stderr, "Error reading capture file %s: %s\n", opt_read,
+            strerror(errno));
+  }
+
+  outputFlush(&out);
+  outputFree(&out);
+  captureReaderFree(reader);
+  return rc < 0 ? 1 : 0;
+}
+
+/**
+ * Reports how many opens trace_entry could not add to infotmp, and so were
+ * not traced.
+ */
+void reportUpdateFailures(int mapFd) {
+  int key = 0;
+  unsigned long long failures;
+  if (bpf_lookup_elem(mapFd, &key, &failures) < 0) {
+    perror("Error reading the infotmp update failures");
+  } else if (failures != 0 && opt_entry_state == ENTRY_STATE_TASK) {
+    fprintf(stderr,
+            "%llu opens were not traced because their task storage could not "
+            "be allocated\n",
+            failures);
+  } else if (failures != 0) {
+    fprintf(stderr,
+            "%llu opens were not traced because infotmp was full (see "
+            "--max-inflight)\n",
+            failures);
+  }
+}
+
+// Where trace_entry finds the first six arguments of the probed function in
+// the x86-64 pt_regs of a kprobe: PT_REGS_PARM1() to PT_REGS_PARM6().
+int kprobeArgOffsets[] = {112, 104, 96, 88, 72, 64};
+
+// Where trace_return finds the return value in the pt_regs of a kretprobe:
+// PT_REGS_RC().
+#define KPROBE_RET_OFFSET 80
+
+// Where trace_return finds the return value in a syscalls:sys_exit_* record,
+// after the common fields and __syscall_nr.
+#define SYS_EXIT_RET_OFFSET 16
+
+// Where the format files of the tracepoints are, depending on whether tracefs
+// is mounted on its own or only under debugfs.
+const char *tracefsPaths[] = {"/sys/kernel/tracing",
+                              "/sys/kernel/debug/tracing"};
+
+/**
+ * A kernel function, or with --attach tracepoint an open syscall, that the
+ * programs are attached to. Its index in attachPoints is the origin that
+ * trace_entry and trace_exit tag its events with.
+ */
+struct attach_point {
+  char name[CAPTURE_ORIGIN_NAME_LEN];
+  // Which argument of the function the filename is, counting from 1.
+  int filenameArg;
+  // Where trace_entry or trace_exit finds the filename in its context, or -1
+  // if this is an optional tracepoint that the kernel does not have.
+  int filenameOffset;
+  // Whether the kernel may not have it, as open() does not exist on arm64.
+  int optional;
+};
+
+struct attach_point attachPoints[MAX_ATTACH_POINTS];
+int numAttachPoints = 0;
+
+/**
+ * Appends an attach point called name, optionally followed by ':' and the
+ * argument that holds the filename. Returns 0, or -1 with errno set.
+ */
+int addAttachPoint(const char *name, size_t len, int optional) {
+  if (numAttachPoints == MAX_ATTACH_POINTS) {
+    errno = E2BIG;
+    return -1;
+  }
+  struct attach_point *point = &attachPoints[numAttachPoints];
+  point->filenameArg = 2;
+  const char *colon = memchr(name, ':', len);
+  if (colon != NULL) {
+    char *end;
+    errno = 0;
+    long arg = strtol(colon + 1, &end, /* base */ 10);
+    if (errno != 0 || end != name + len || end == colon + 1 || arg < 1 ||
+        arg > (long)(sizeof(kprobeArgOffsets) / sizeof(kprobeArgOffsets[0]))) {
+      errno = EINVAL;
+      return -1;
+    }
+    point->filenameArg = arg;
+    len = colon - name;
+  }
+  if (len == 0 || len >= sizeof(point->name)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(point->name, name, len);
+  point->name[len] = '\0';
+  point->filenameOffset = -1;
+  point->optional = optional;
+  numAttachPoints++;
+  return 0;
+}
+
+// Room for the name of an attach point and the prefix that eventNameFor()
+// puts before it.
+#define EVENT_NAME_LEN (CAPTURE_ORIGIN_NAME_LEN + 16)
+
+/**
+ * Fills in the name of the kprobe event or the tracepoint for point: prefix
+ * followed by its name.
+ */
+void eventNameFor(const char *prefix, const struct attach_point *point,
+                  char eventName[EVENT_NAME_LEN]) {
+  size_t prefixLen = strlen(prefix);
+  memcpy(eventName, prefix, prefixLen);
+  memcpy(eventName + prefixLen, point->name,
+         strnlen(point->name, sizeof(point->name) - 1) + 1);
+}
+
+/**
+ * Returns where the filename field is in the records of the
+ * syscalls:sys_enter_<syscall> tracepoint, per its format file, or -1 with
+ * errno set: ENOENT if the kernel has no such tracepoint.
+ */
+int findTracepointFilenameOffset(const char *syscall) {
+  FILE *file = NULL;
+  for (int i = 0; file == NULL && i < 2; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/events/syscalls/sys_enter_%s/format",
+             tracefsPaths[i], syscall);
+    file = fopen(path, "re");
+  }
+  if (file == NULL) {
+    return -1;
+  }
+
+  // The line looks like:
+  //   field:const char * filename;	offset:24;	size:8;	signed:0;
+  char line[256];
+  int offset = -1;
+  while (offset == -1 && fgets(line, sizeof(line), file) != NULL) {
+    const char *field = strstr(line, " filename;");
+    const char *offsetField = strstr(line, "offset:");
+    if (field != NULL && offsetField != NULL && field < offsetField) {
+      offset = atoi(offsetField + strlen("offset:"));
+    }
+  }
+  fclose(file);
+  if (offset == -1) {
+    errno = EINVAL;
+  }
+  return offset;
+}
+
+/**
+ * Fills in attachPoints for the --attach mode, which must not be
+ * ATTACH_AUTO, from the --attach-to arguments or the defaults, and works out
+ * where each one has its filename. Returns 0, or prints why and returns -1.
+ */
+int resolveAttachPoints(enum attach_mode mode) {
+  numAttachPoints = 0;
+  for (int i = 0; i < opt_num_attach_to; i++) {
+    const char *start = opt_attach_to[i];
+    while (*start != '\0') {
+      const char *end = strchrnul(start, ',');
+      if (addAttachPoint(start, end - start, /* optional */ 0) < 0) {
+        fprintf(stderr, "Invalid value for --attach-to: '%s' (%s)\n",
+                opt_attach_to[i],
+                errno == E2BIG ? "too many entry points"
+                                : "bad name or argument");
+        return -1;
+      }
+      start = *end == ',' ? end + 1 : end;
+    }
+  }
+
+  if (numAttachPoints == 0) {
+    if (mode == ATTACH_TRACEPOINT) {
+      addAttachPoint("openat", strlen("openat"), /* optional */ 0);
+      addAttachPoint("open", strlen("open"), /* optional */ 1);
+      addAttachPoint("openat2", strlen("openat2"), /* optional */ 1);
+    } else if (mode == ATTACH_FEXIT) {
+      // do_sys_open() calls do_sys_openat2() since Linux 5.6, so only one of
+      // them is traced to not see every open twice.
+      int numArgs;
+      const char *function =
+          btfFindKernelFunction("do_sys_openat2", &numArgs) >= 0
+              ? "do_sys_openat2"
+              : "do_sys_open";
+      addAttachPoint(function, strlen(function), /* optional */ 0);
+    } else {
+      addAttachPoint("do_sys_open", strlen("do_sys_open"), /* optional */ 0);
+    }
+  }
+
+  for (int i = 0; i < numAttachPoints; i++) {
+    struct attach_point *point = &attachPoints[i];
+    if (mode == ATTACH_KPROBE) {
+      point->filenameOffset = kprobeArgOffsets[point->filenameArg - 1];
+    } else if (mode == ATTACH_FEXIT) {
+      point->filenameOffset = (point->filenameArg - 1) * sizeof(__u64);
+    } else {
+      // The format file says where the filename is, whatever its argument.
+      point->filenameOffset = findTracepointFilenameOffset(point->name);
+      if (point->filenameOffset < 0 &&
+          !(errno == ENOENT && point->optional)) {
+        fprintf(stderr, "Failed to find the filename of the %s syscall: %s\n",
+                point->name, strerror(errno));
+        return -1;
+      }
+    }
+    originNames[i] = point->name;
+  }
+  numOrigins = numAttachPoints;
+  return 0;
+}
+
+/**
+ * Returns the flags for how trace_return and trace_exit send events on the
+ * command line.
+ */
+unsigned sendFlags() {
+  // With -x, successful opens are dropped in the kernel, before the filename
+  // is even read.
+  unsigned flags = opt_failed ? PROGRAM_FAILED : 0;
+  if (opt_ringbuf) {
+    flags |= PROGRAM_RINGBUF;
+    if (opt_wakeup_events != 0 || opt_wakeup_bytes != 0) {
+      flags |= PROGRAM_BATCHED;
+    }
+  }
+  return flags;
+}
+
+/**
+ * Fills in insns with part of --filter, if it was given, followed by the
+ * variant of program that flags ask for, and returns their number of
+ * instructions, or -1 with errno set. insns must have room for
+ * FILTER_MAX_INSTRUCTIONS more than the program.
+ */
+int assembleFilteredProgram(enum program program, unsigned flags,
+                            enum filter_part part,
+                            const struct program_args *args,
+                            struct bpf_insn insns[]) {
+  int numFilterInstructions = 0;
+  if (opt_filter != NULL) {
+    numFilterInstructions =
+        filterCompile(opt_filter, part, args->retOffset, insns);
+    if (numFilterInstructions < 0) {
+      return -1;
+    }
+  }
+  int numInstructions =
+      assembleProgram(program, flags, args, insns + numFilterInstructions);
+  return numInstructions < 0 ? -1 : numFilterInstructions + numInstructions;
+}
+
+/**
+ * Fills in insns with the trace_entry variant for the command line and returns
+ * its number of instructions, or -1 with errno set.
+ */
+int generateTraceEntry(struct bpf_insn insns[],
+                       const struct program_args *args) {
+  unsigned flags = 0;
+  if (opt_num_tids != 0) {
+    flags |= PROGRAM_TIDS;
+  } else if (opt_num_pids != 0) {
+    flags |= PROGRAM_PIDS;
+  } else if (opt_num_cgroups != 0) {
+    flags |= PROGRAM_CGROUPS;
+  }
+  // With --comm, other processes are dropped right after their comm is read.
+  // With --sample, all but 1 in opt_sample opens are dropped even before that.
+  if (opt_num_comms != 0) {
+    flags |= PROGRAM_COMMS;
+  }
+  if (opt_sample > 1) {
+    flags |= PROGRAM_SAMPLED;
+  }
+  if (opt_entry_state == ENTRY_STATE_TASK) {
+    flags |= PROGRAM_TASK_STORAGE;
+  }
+  // The parts of --filter that do not need the return value drop opens before
+  // anything is saved for trace_return.
+  return assembleFilteredProgram(PROGRAM_TRACE_ENTRY, flags, FILTER_ENTRY, args,
+                                 insns);
+}
+
+/**
+ * Fills in insns with the trace_return variant for the command line and returns
+ * its number of instructions, or -1 with errno set.
+ */
+int generateTraceReturn(struct bpf_insn insns[],
+                        const struct program_args *args) {
+  unsigned flags =
+      opt_entry_state == ENTRY_STATE_TASK ? PROGRAM_TASK_STORAGE : 0;
+  // With --prefix, opens of other files are dropped right after the filename
+  // is read, and with --dedup, so are repeated opens of the same file.
+  if (opt_num_prefixes != 0) {
+    flags |= PROGRAM_PREFIXES;
+  }
+  if (opt_aggregate != -1) {
+    flags |= PROGRAM_AGGREGATE | (opt_failed ? PROGRAM_FAILED : 0);
+  } else if (opt_latency != -1) {
+    flags |= PROGRAM_LATENCY | (opt_failed ? PROGRAM_FAILED : 0);
+  } else {
+    flags |= sendFlags();
+    if (opt_dedup != -1) {
+      flags |= PROGRAM_DEDUP;
+    }
+  }
+  // The part of --filter that compares ret runs in front of trace_return.
+  if (opt_filter != NULL && filterUsesReturn(opt_filter)) {
+    flags |= PROGRAM_FILTERED;
+  }
+  return assembleFilteredProgram(PROGRAM_TRACE_RETURN, flags, FILTER_RETURN,
+                                 args, insns);
+}
+
+/**
+ * Fills in insns with the trace_exit variant for --entry-only and the rest of
+ * the command line and returns its number of instructions, or -1 with errno
+ * set.
+ */
+int generateTraceEntryOnly(struct bpf_insn insns[],
+                           const struct program_args *args) {
+  return assembleFilteredProgram(PROGRAM_TRACE_EXIT,
+                                 sendFlags() | PROGRAM_ENTRY_ONLY, FILTER_ALL,
+                                 args, insns);
+}
+
+/**
+ * Loads the trace_exit variant for the command line as an fexit program on the
+ * function of attachPoints[origin] and attaches it, linked with the maps and
+ * options in args. Returns the fd of the attachment and sets *progFd, or
+ * returns -1 with errno set: ENOENT if the kernel has no BTF to attach by.
+ */
+int attachTraceExit(int origin, const struct program_args *args,
+                    int *progFd) {
+  const struct attach_point *point = &attachPoints[origin];
+  int numArgs;
+  int btfId = btfFindKernelFunction(point->name, &numArgs);
+  if (btfId < 0) {
+    return -1;
+  }
+  if (point->filenameArg > numArgs) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct program_args exitArgs = *args;
+  exitArgs.filenameOffset = point->filenameOffset;
+  // The return value comes after the last argument.
+  exitArgs.retOffset = numArgs * sizeof(__u64);
+  exitArgs.origin = origin;
+  struct bpf_insn
+      insns[FILTER_MAX_INSTRUCTIONS + MAX_NUM_TRACE_EXIT_INSTRUCTIONS];
+  int numInstructions = assembleFilteredProgram(
+      PROGRAM_TRACE_EXIT, sendFlags(), FILTER_ALL, &exitArgs, insns);
+  if (numInstructions < 0) {
+    return -1;
+  }
+
+  // bcc's bpf_prog_load() cannot set the attach target that fexit programs
+  // are verified against, so this goes straight to bpf(2).
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_TRACING;
+  attr.expected_attach_type = BPF_TRACE_FEXIT;
+  attr.attach_btf_id = btfId;
+  attr.insns = (__u64)(unsigned long)insns;
+  attr.insn_cnt = numInstructions;
+  attr.license = (__u64)(unsigned long)"GPL";
+  strncpy(attr.prog_name, "trace_exit", sizeof(attr.prog_name) - 1);
+  *progFd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+  if (*progFd < 0) {
+    return -1;
+  }
+
+  // An fexit program is attached by opening a raw tracepoint without a name.
+  memset(&attr, 0, sizeof(attr));
+  attr.raw_tracepoint.prog_fd = *progFd;
+  return syscall(__NR_bpf, BPF_RAW_TRACEPOINT_OPEN, &attr, sizeof(attr));
+}
+
+/**
+ * Creates the task storage map that the _task variants of trace_entry and
+ * trace_return keep their val_t in, and checks that a kprobe or tracepoint
+ * program may use it. Returns its fd, or -1 with errno set if the kernel does
+ * not support that (before Linux 5.11).
+ */
+int createTaskStorageMap(void) {
+  __u32 keyTypeId, valueTypeId;
+  int btfFd =
+      btfLoadMapTypes(sizeof(struct val_t), &keyTypeId, &valueTypeId);
+  if (btfFd < 0) {
+    return -1;
+  }
+
+  // bcc's bpf_create_map() cannot pass the BTF that task storage maps must be
+  // created with, so this goes straight to bpf(2).
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_TASK_STORAGE;
+  attr.key_size = sizeof(int);
+  attr.value_size = sizeof(struct val_t);
+  // A task's storage is allocated by its first traced open, and freed along
+  // with the task.
+  attr.map_flags = BPF_F_NO_PREALLOC;
+  attr.btf_fd = btfFd;
+  attr.btf_key_type_id = keyTypeId;
+  attr.btf_value_type_id = valueTypeId;
+  strncpy(attr.map_name, "infotmp", sizeof(attr.map_name) - 1);
+  int mapFd = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+  int savedErrno = errno;
+  close(btfFd);
+  if (mapFd < 0) {
+    errno = savedErrno;
+    return -1;
+  }
+
+  // Kernels that have the map type do not all let kprobe programs call its
+  // helpers. Tracepoint programs are allowed exactly the same ones.
+  struct bpf_insn probe[] = {
+      {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_get_current_task_btf},
+      {.code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = 2, .src_reg = 0},
+      {.code = BPF_LD | BPF_DW | BPF_IMM,
+       .dst_reg = 1,
+       .src_reg = BPF_PSEUDO_MAP_FD,
+       .imm = mapFd},
+      {0},
+      {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = 3, .imm = 0},
+      {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = 4, .imm = 0},
+      {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_task_storage_get},
+      {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = 0, .imm = 0},
+      {.code = BPF_JMP | BPF_EXIT},
+  };
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_KPROBE;
+  attr.insns = (__u64)(unsigned long)probe;
+  attr.insn_cnt = sizeof(probe) / sizeof(probe[0]);
+  attr.license = (__u64)(unsigned long)"GPL";
+  int progFd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+  if (progFd < 0) {
+    savedErrno = errno;
+    close(mapFd);
+    errno = savedErrno;
+    return -1;
+  }
+  close(progFd);
+  return mapFd;
+}
+
+int main(int argc, char **argv) {
+  parseArgs(argc, argv);
+  if (opt_read != NULL) {
+    return replayCapture();
+  }
+  if (opt_num_tids != 0) {
+    eventFlags |= CAPTURE_FLAG_TID;
+  }
+  if (opt_dedup != -1) {
+    eventFlags |= CAPTURE_FLAG_DEDUP;
+  }
+  if (opt_entry_only) {
+    eventFlags |= CAPTURE_FLAG_ENTRY_ONLY;
+  }
+
+  bpf_log_buf[0] = '\0';
+  int infotmpMapFd = -1, eventsMapFd = -1, commsMapFd = -1,
+      aggregatesMapFd = -1, latencyMapFd = -1, updateFailuresMapFd = -1,
+      scratchMapFd = -1, pidsMapFd = -1, cgroupsMapFd = -1, prefixesMapFd = -1,
+      dedupMapFd = -1, returnProgFd = -1;
+  // The programs and their attachments, one per attach point.
+  int entryProgFds[MAX_ATTACH_POINTS], entryProbeFds[MAX_ATTACH_POINTS],
+      returnProbeFds[MAX_ATTACH_POINTS], exitProgFds[MAX_ATTACH_POINTS],
+      exitProbeFds[MAX_ATTACH_POINTS];
+  for (int i = 0; i < MAX_ATTACH_POINTS; i++) {
+    entryProgFds[i] = entryProbeFds[i] = returnProbeFds[i] = -1;
+    exitProgFds[i] = exitProbeFds[i] = -1;
+  }
+  int pinnedPids = 0;
+  struct perf_reader **readers = NULL;
+  struct cpu_buffer *buffers = NULL;
+  struct ringbuf_reader *ringbuf = NULL;
+  struct consumer *consumers = NULL;
+  int numConsumers = 0, numStartedConsumers = 0;
+  int exitCode = 1;
+  int *cpus = NULL;
+  size_t numCpu = 0;
+  if (getOnlineCpus(&cpus, &numCpu) < 0) {
+    perror("Failure in getOnlineCpus()");
+    goto error;
+  }
+
+  readers = calloc(numCpu, sizeof(struct perf_reader *));
+  if (readers == NULL) {
+    goto error;
+  }
+
+  // In --ringbuf mode, only the first one is used, for the ring buffer.
+  buffers = calloc(numCpu, sizeof(struct cpu_buffer));
+  if (buffers == NULL) {
+    goto error;
+  }
+  for (int cpuIndex = 0; cpuIndex < numCpu; cpuIndex++) {
+    buffers[cpuIndex].cpu = opt_ringbuf ? -1 : cpus[cpuIndex];
+    buffers[cpuIndex].pageCnt =
+        opt_ringbuf ? RINGBUF_PAGE_CNT : PERF_BUFFER_PAGE_CNT;
+  }
+
+  // Split the online CPUs into contiguous, disjoint ranges, one per consumer.
+  // Without --threads, there is a single consumer that is not pinned.
+  numConsumers = opt_threads == 0 ? 1 : opt_threads;
+  if (numConsumers > numCpu) {
+    numConsumers = numCpu;
+  }
+  consumers = calloc(numConsumers, sizeof(struct consumer));
+  if (consumers == NULL) {
+    goto error;
+  }
+  for (int i = 0; i < numConsumers; i++) {
+    int first = i * numCpu / numConsumers;
+    int last = (i + 1) * numCpu / numConsumers;
+    consumers[i].readers = readers + first;
+    consumers[i].buffers = buffers + first;
+    consumers[i].numReaders = last - first;
+    CPU_ZERO(&consumers[i].cpuSet);
+    for (int cpuIndex = first; cpuIndex < last; cpuIndex++) {
+      CPU_SET(cpus[cpuIndex], &consumers[i].cpuSet);
+      buffers[cpuIndex].out = &consumers[i].out;
+      buffers[cpuIndex].block = &consumers[i].block;
+    }
+    if (outputInit(&consumers[i].out, STDOUT_FILENO, opt_flush,
+                   OUTPUT_BUFFER_SIZE) < 0) {
+      perror("Error allocating the output buffer");
+      goto error;
+    }
+    if (opt_write != NULL && captureBlockInit(&consumers[i].block) < 0) {
+      perror("Error allocating the capture buffer");
+      goto error;
+    }
+  }
+
+  long pageSize = sysconf(_SC_PAGESIZE);
+
+  // A watermark that can never be reached would leave only --max-latency to
+  // wake the consumer up.
+  long bufferSize = (opt_ringbuf ? RINGBUF_PAGE_CNT : PERF_BUFFER_PAGE_CNT) *
+                    pageSize;
+  if (opt_wakeup_bytes >= bufferSize) {
+    fprintf(stderr, "--wakeup-bytes must be less than the buffer size (%ld)\n",
+            bufferSize);
     goto error;
   }
 
@@ -304,103 +2507,468 @@ int main(int argc, char **argv) {
   // https://github.com/iovisor/bcc/commit/bfecc243fc8e822417836dd76a9b4028a5d8c2c9.
   unsigned int kern_version = LINUX_VERSION_CODE;
 
-  // BPF_HASH
-  const char *hashMapName = "hashMap name for debugging";
-  hashMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, hashMapName,
-                             /* key_size */ sizeof(__u64),
-                             /* value_size */ sizeof(struct val_t),
-                             /* max_entries */ 10240,
-                             /* map_flags */ 0);
-  if (hashMapFd < 0) {
-    perror("Failed to create BPF_HASH");
+  // BPF_TASK_STORAGE. trace_entry cannot keep its state in a per-CPU slot
+  // instead of a hash, because opens can sleep, and another task can then
+  // start an open on the same CPU, or the task can move to another one.
+  if (opt_entry_state != ENTRY_STATE_HASH) {
+    infotmpMapFd = createTaskStorageMap();
+    if (infotmpMapFd >= 0) {
+      opt_entry_state = ENTRY_STATE_TASK;
+    } else if (opt_entry_state == ENTRY_STATE_TASK) {
+      perror("Failed to create BPF_TASK_STORAGE (requires Linux 5.11)");
+      goto error;
+    } else {
+      opt_entry_state = ENTRY_STATE_HASH;
+    }
+  }
+
+  // BPF_TABLE("lru_hash"). An entry whose kretprobe never fires (because the
+  // task was killed, or more opens were in flight than the kretprobe's
+  // maxactive) would otherwise stay in the map for good, and once the map
+  // filled up, every open would be dropped.
+  if (opt_entry_state == ENTRY_STATE_HASH) {
+    const char *hashMapName = "hashMap name for debugging";
+    infotmpMapFd = bpf_create_map(BPF_MAP_TYPE_LRU_HASH, hashMapName,
+                                  /* key_size */ sizeof(__u64),
+                                  /* value_size */ sizeof(struct val_t),
+                                  /* max_entries */ opt_max_inflight,
+                                  /* map_flags */ 0);
+    if (infotmpMapFd < 0) {
+      perror("Failed to create BPF_TABLE(\"lru_hash\")");
+      goto error;
+    }
+  }
+
+  // BPF_ARRAY
+  const char *updateFailuresMapName = "update_failures name for debugging";
+  updateFailuresMapFd = bpf_create_map(BPF_MAP_TYPE_ARRAY,
+                                       updateFailuresMapName,
+                                       /* key_size */ sizeof(int),
+                                       /* value_size */ sizeof(__u64),
+                                       /* max_entries */ 1,
+                                       /* map_flags */ 0);
+  if (updateFailuresMapFd < 0) {
+    perror("Failed to create BPF_ARRAY");
     goto error;
   }
 
-  // BPF_PERF_OUTPUT
-  const char *perfMapName = "perfMap name for debugging";
-  eventsMapFd = bpf_create_map(BPF_MAP_TYPE_PERF_EVENT_ARRAY, perfMapName,
-                               /* key_size */ sizeof(int),
-                               /* value_size */ sizeof(__u32),
-                               /* max_entries */ numCpu,
+  if (opt_num_pids != 0 || opt_num_tids != 0) {
+    // BPF_HASH
+    const char *pidsMapName = "pids name for debugging";
+    pidsMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, pidsMapName,
+                               /* key_size */ sizeof(__u32),
+                               /* value_size */ sizeof(__u8),
+                               /* max_entries */ MAX_PIDS,
                                /* map_flags */ 0);
+    if (pidsMapFd < 0) {
+      perror("Failed to create BPF_HASH for -p or -t");
+      goto error;
+    }
 
-  if (eventsMapFd < 0) {
-    perror("Failed to create BPF_PERF_OUTPUT");
-    goto error;
+    if (addIds(opt_pids, opt_num_pids, /* threads */ 0, pidsMapFd) < 0 ||
+        addIds(opt_tids, opt_num_tids, /* threads */ 1, pidsMapFd) < 0) {
+      goto error;
+    }
+
+    // A supervisor can then add and remove workers without restarting us.
+    if (opt_pin_pids != NULL) {
+      if (bpf_obj_pin(pidsMapFd, opt_pin_pids) < 0) {
+        fprintf(stderr, "Error pinning the PIDs to %s: %s\n", opt_pin_pids,
+                strerror(errno));
+        goto error;
+      }
+      pinnedPids = 1;
+    }
+  }
+
+  if (opt_num_cgroups != 0) {
+    // BPF_HASH
+    const char *cgroupsMapName = "cgroups name for debugging";
+    cgroupsMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, cgroupsMapName,
+                                  /* key_size */ sizeof(__u64),
+                                  /* value_size */ sizeof(__u8),
+                                  /* max_entries */ MAX_CGROUPS,
+                                  /* map_flags */ 0);
+    if (cgroupsMapFd < 0) {
+      perror("Failed to create BPF_HASH for --cgroup");
+      goto error;
+    }
+
+    for (int i = 0; i < opt_num_cgroups; i++) {
+      __u64 id;
+      __u8 value = 1;
+      if (getCgroupId(opt_cgroups[i], &id) < 0) {
+        fprintf(stderr, "Error looking up cgroup %s: %s\n", opt_cgroups[i],
+                errno == ENOTDIR ? "Not a cgroup v2 directory"
+                                 : strerror(errno));
+        goto error;
+      }
+      if (bpf_update_elem(cgroupsMapFd, &id, &value, BPF_ANY) < 0) {
+        perror("Error calling bpf_update_elem() for --cgroup");
+        goto error;
+      }
+    }
+  }
+
+  if (opt_num_comms != 0) {
+    // BPF_LPM_TRIE
+    const char *commsMapName = "comms name for debugging";
+    commsMapFd = bpf_create_map(BPF_MAP_TYPE_LPM_TRIE, commsMapName,
+                                /* key_size */ sizeof(struct comm_key),
+                                /* value_size */ sizeof(__u8),
+                                /* max_entries */ MAX_COMMS,
+                                /* map_flags */ BPF_F_NO_PREALLOC);
+    if (commsMapFd < 0) {
+      perror("Failed to create BPF_LPM_TRIE");
+      goto error;
+    }
+
+    for (int i = 0; i < opt_num_comms; i++) {
+      struct comm_key key;
+      __u8 value = 1;
+      commKeyFor(opt_comms[i], &key);
+      if (bpf_update_elem(commsMapFd, &key, &value, BPF_ANY) < 0) {
+        perror("Error calling bpf_update_elem() for --comm");
+        goto error;
+      }
+    }
+  }
+
+  if (opt_num_prefixes != 0) {
+    // BPF_LPM_TRIE
+    const char *prefixesMapName = "prefixes name for debugging";
+    prefixesMapFd = bpf_create_map(BPF_MAP_TYPE_LPM_TRIE, prefixesMapName,
+                                   /* key_size */ sizeof(struct prefix_key),
+                                   /* value_size */ sizeof(__u8),
+                                   /* max_entries */ MAX_PREFIXES,
+                                   /* map_flags */ BPF_F_NO_PREALLOC);
+    if (prefixesMapFd < 0) {
+      perror("Failed to create BPF_LPM_TRIE for --prefix");
+      goto error;
+    }
+
+    for (int i = 0; i < opt_num_prefixes; i++) {
+      struct prefix_key key = {0};
+      __u8 value = 1;
+      size_t len = strlen(opt_prefixes[i]);
+      key.prefixlen = len * 8;
+      memcpy(key.path, opt_prefixes[i], len);
+      if (bpf_update_elem(prefixesMapFd, &key, &value, BPF_ANY) < 0) {
+        perror("Error calling bpf_update_elem() for --prefix");
+        goto error;
+      }
+    }
   }
 
-  const char *prog_name_for_kprobe = "some kprobe";
-  int numTraceEntryInstructions;
-  struct bpf_insn trace_entry_insns[MAX_NUM_TRACE_ENTRY_INSTRUCTIONS];
-  if (opt_tid != -1) {
-    generate_trace_entry_tid(trace_entry_insns, opt_tid, hashMapFd);
-    numTraceEntryInstructions = NUM_TRACE_ENTRY_TID_INSTRUCTIONS;
-  } else if (opt_pid != -1) {
-    generate_trace_entry_pid(trace_entry_insns, opt_pid, hashMapFd);
-    numTraceEntryInstructions = NUM_TRACE_ENTRY_PID_INSTRUCTIONS;
+  if (opt_aggregate != -1) {
+    // BPF_HASH
+    const char *aggregatesMapName = "aggregates name for debugging";
+    aggregatesMapFd =
+        bpf_create_map(BPF_MAP_TYPE_HASH, aggregatesMapName,
+                       /* key_size */ sizeof(struct aggregate_key),
+                       /* value_size */ sizeof(__u64),
+                       /* max_entries */ MAX_AGGREGATES,
+                       /* map_flags */ 0);
+    if (aggregatesMapFd < 0) {
+      perror("Failed to create BPF_HASH for --aggregate");
+      goto error;
+    }
+  } else if (opt_latency != -1) {
+    // BPF_HISTOGRAM
+    const char *latencyMapName = "latency name for debugging";
+    latencyMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, latencyMapName,
+                                  /* key_size */ sizeof(struct latency_key),
+                                  /* value_size */ sizeof(__u64),
+                                  /* max_entries */ MAX_LATENCY_KEYS,
+                                  /* map_flags */ 0);
+    if (latencyMapFd < 0) {
+      perror("Failed to create BPF_HISTOGRAM");
+      goto error;
+    }
+  } else if (opt_ringbuf) {
+    // BPF_RINGBUF_OUTPUT
+    const char *ringbufMapName = "ringbuf name for debugging";
+    eventsMapFd = bpf_create_map(BPF_MAP_TYPE_RINGBUF, ringbufMapName,
+                                 /* key_size */ 0,
+                                 /* value_size */ 0,
+                                 /* max_entries */ RINGBUF_PAGE_CNT * pageSize,
+                                 /* map_flags */ 0);
+    if (eventsMapFd < 0) {
+      perror("Failed to create BPF_RINGBUF_OUTPUT");
+      goto error;
+    }
   } else {
-    numTraceEntryInstructions = NUM_TRACE_ENTRY_INSTRUCTIONS;
-    generate_trace_entry(trace_entry_insns, hashMapFd);
+    // BPF_PERF_OUTPUT
+    const char *perfMapName = "perfMap name for debugging";
+    eventsMapFd = bpf_create_map(BPF_MAP_TYPE_PERF_EVENT_ARRAY, perfMapName,
+                                 /* key_size */ sizeof(int),
+                                 /* value_size */ sizeof(__u32),
+                                 /* max_entries */ numCpu,
+                                 /* map_flags */ 0);
+    if (eventsMapFd < 0) {
+      perror("Failed to create BPF_PERF_OUTPUT");
+      goto error;
+    }
   }
 
-  entryProgFd = bpf_prog_load(
-      BPF_PROG_TYPE_KPROBE, prog_name_for_kprobe, trace_entry_insns,
-      /* prog_len */ numTraceEntryInstructions * sizeof(struct bpf_insn),
-      /* license */ "GPL", kern_version,
-      /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
-  if (entryProgFd == -1) {
-    perror("Error calling bpf_prog_load() for kretprobe");
-    goto error;
+  if (sendsEvents()) {
+    // BPF_PERCPU_ARRAY
+    const char *scratchMapName = "scratch name for debugging";
+    scratchMapFd = bpf_create_map(BPF_MAP_TYPE_PERCPU_ARRAY, scratchMapName,
+                                  /* key_size */ sizeof(int),
+                                  /* value_size */ sizeof(struct data_t),
+                                  /* max_entries */ 1,
+                                  /* map_flags */ 0);
+    if (scratchMapFd < 0) {
+      perror("Failed to create BPF_PERCPU_ARRAY");
+      goto error;
+    }
   }
 
-  kprobeFd = bpf_attach_kprobe(entryProgFd, BPF_PROBE_ENTRY, "p_do_sys_open",
-                               "do_sys_open",
-                               /* fn_offset */ 0);
-  if (kprobeFd < 0) {
-    perror("Error calling bpf_attach_kprobe() for kprobe");
-    goto error;
+  if (opt_dedup != -1) {
+    // BPF_TABLE("lru_hash")
+    const char *dedupMapName = "dedup name for debugging";
+    dedupMapFd = bpf_create_map(BPF_MAP_TYPE_LRU_HASH, dedupMapName,
+                                /* key_size */ sizeof(__u64),
+                                /* value_size */ sizeof(struct dedup_val),
+                                /* max_entries */ MAX_DEDUP_KEYS,
+                                /* map_flags */ 0);
+    if (dedupMapFd < 0) {
+      perror("Failed to create BPF_TABLE(\"lru_hash\") for --dedup");
+      goto error;
+    }
   }
 
-  const char *prog_name_for_kretprobe = "some kretprobe";
-  struct bpf_insn trace_return_insns[NUM_TRACE_RETURN_INSTRUCTIONS];
-  generate_trace_return(trace_return_insns, hashMapFd, eventsMapFd);
+  // The programs are linked with the maps and the options that they all share,
+  // and each attach point fills in its own offsets and origin.
+  struct program_args args;
+  memset(&args, 0, sizeof(args));
+  args.fnameSize = opt_long_paths ? LONG_FNAME_MAX : NAME_MAX;
+  args.sample = opt_sample;
+  // The ring buffer has no wakeup_events equivalent, so an event count is
+  // converted to the size of that many records of a typical length.
+  args.watermark = opt_wakeup_events != 0
+                       ? opt_wakeup_events * RINGBUF_TYPICAL_RECORD_SIZE
+                       : opt_wakeup_bytes;
+  args.dedupWindow = opt_dedup;
+  args.infotmpMapFd = infotmpMapFd;
+  args.eventsMapFd = eventsMapFd;
+  args.commsMapFd = commsMapFd;
+  args.aggregatesMapFd = aggregatesMapFd;
+  args.latencyMapFd = latencyMapFd;
+  args.updateFailuresMapFd = updateFailuresMapFd;
+  args.scratchMapFd = scratchMapFd;
+  args.pidsMapFd = pidsMapFd;
+  args.cgroupsMapFd = cgroupsMapFd;
+  args.prefixesMapFd = prefixesMapFd;
+  args.dedupMapFd = dedupMapFd;
 
-  returnProgFd = bpf_prog_load(
-      BPF_PROG_TYPE_KPROBE, prog_name_for_kretprobe, trace_return_insns,
-      /* prog_len */ NUM_TRACE_RETURN_INSTRUCTIONS * sizeof(struct bpf_insn),
-      /* license */ "GPL", kern_version,
-      /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
-  if (returnProgFd == -1) {
-    perror("Error calling bpf_prog_load() for kretprobe");
-    goto error;
+  // With --attach auto, trace_exit is used where the kernel can attach it,
+  // and the kprobe pair is the fallback. --entry-only always uses a kprobe or
+  // a tracepoint.
+  if ((opt_attach == ATTACH_AUTO && !opt_entry_only &&
+       traceExitSupportsOptions()) ||
+      opt_attach == ATTACH_FEXIT) {
+    if (resolveAttachPoints(ATTACH_FEXIT) < 0) {
+      goto error;
+    }
+    for (int i = 0; i < numAttachPoints; i++) {
+      exitProbeFds[i] = attachTraceExit(i, &args, &exitProgFds[i]);
+      if (exitProbeFds[i] >= 0) {
+        continue;
+      }
+      if (opt_attach == ATTACH_FEXIT) {
+        fprintf(stderr, "Error attaching trace_exit to %s with fexit: %s\n",
+                attachPoints[i].name, strerror(errno));
+        goto error;
+      }
+      // Fall back for all of them, not only the ones that failed.
+      for (int j = 0; j <= i; j++) {
+        if (exitProbeFds[j] != -1) {
+          close(exitProbeFds[j]);
+        }
+        if (exitProgFds[j] >= 0) {
+          close(exitProgFds[j]);
+        }
+        exitProbeFds[j] = exitProgFds[j] = -1;
+      }
+      break;
+    }
+    if (exitProbeFds[0] != -1) {
+      opt_attach = ATTACH_FEXIT;
+    }
+  }
+  if (opt_attach == ATTACH_AUTO) {
+    opt_attach = ATTACH_KPROBE;
   }
 
-  kretprobeFd = bpf_attach_kprobe(returnProgFd, BPF_PROBE_RETURN,
-                                  "r_do_sys_open", "do_sys_open",
-                                  /* fn_offset */ 0);
-  if (kretprobeFd < 0) {
-    perror("Error calling bpf_attach_kprobe() for kretprobe");
-    goto error;
+  if (opt_attach != ATTACH_FEXIT) {
+    if (resolveAttachPoints(opt_attach) < 0) {
+      goto error;
+    }
+
+    // Each attach point gets its own copy of trace_entry, as the filename is
+    // at its own offset in each of their contexts, and each tags its events
+    // with its own origin. They all share infotmp, so one trace_return serves
+    // all of them. With --entry-only, trace_entry is the trace_exit variant
+    // that sends the event itself.
+    enum bpf_prog_type progType = opt_attach == ATTACH_KPROBE
+                                      ? BPF_PROG_TYPE_KPROBE
+                                      : BPF_PROG_TYPE_TRACEPOINT;
+    const char *prog_name_for_kprobe = "some kprobe";
+    struct bpf_insn
+        trace_entry_insns[FILTER_MAX_INSTRUCTIONS +
+                          MAX_NUM_TRACE_ENTRY_INSTRUCTIONS];
+    struct bpf_insn
+        trace_entry_only_insns[FILTER_MAX_INSTRUCTIONS +
+                               MAX_NUM_TRACE_EXIT_INSTRUCTIONS];
+    for (int i = 0; i < numAttachPoints; i++) {
+      const struct attach_point *point = &attachPoints[i];
+      // Skip the syscalls that this kernel does not have.
+      if (point->filenameOffset == -1) {
+        continue;
+      }
+      args.filenameOffset = point->filenameOffset;
+      args.origin = i;
+      struct bpf_insn *insns = trace_entry_insns;
+      int numTraceEntryInstructions;
+      if (opt_entry_only) {
+        insns = trace_entry_only_insns;
+        numTraceEntryInstructions = generateTraceEntryOnly(insns, &args);
+      } else {
+        numTraceEntryInstructions = generateTraceEntry(insns, &args);
+      }
+      if (numTraceEntryInstructions < 0) {
+        perror("Error assembling trace_entry");
+        goto error;
+      }
+      entryProgFds[i] = bpf_prog_load(
+          progType, prog_name_for_kprobe, insns,
+          /* prog_len */ numTraceEntryInstructions * sizeof(struct bpf_insn),
+          /* license */ "GPL", kern_version,
+          /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
+      if (entryProgFds[i] == -1) {
+        perror("Error calling bpf_prog_load() for kprobe");
+        goto error;
+      }
+
+      char eventName[EVENT_NAME_LEN];
+      if (opt_attach == ATTACH_KPROBE) {
+        eventNameFor("p_", point, eventName);
+        entryProbeFds[i] =
+            bpf_attach_kprobe(entryProgFds[i], BPF_PROBE_ENTRY, eventName,
+                              point->name, /* fn_offset */ 0);
+      } else {
+        eventNameFor("sys_enter_", point, eventName);
+        entryProbeFds[i] =
+            bpf_attach_tracepoint(entryProgFds[i], "syscalls", eventName);
+      }
+      if (entryProbeFds[i] < 0) {
+        fprintf(stderr, "Error attaching trace_entry to %s: %s\n",
+                point->name, strerror(errno));
+        goto error;
+      }
+    }
+
+    // With --entry-only, the events were all sent by then, so nothing is
+    // attached where the open returns.
+    if (!opt_entry_only) {
+      const char *prog_name_for_kretprobe = "some kretprobe";
+      args.retOffset =
+          opt_attach == ATTACH_KPROBE ? KPROBE_RET_OFFSET : SYS_EXIT_RET_OFFSET;
+      struct bpf_insn
+          trace_return_insns[FILTER_MAX_INSTRUCTIONS +
+                             MAX_NUM_TRACE_RETURN_INSTRUCTIONS];
+      int numTraceReturnInstructions =
+          generateTraceReturn(trace_return_insns, &args);
+      if (numTraceReturnInstructions < 0) {
+        perror("Error assembling trace_return");
+        goto error;
+      }
+
+      // The verifier walks the --dedup hash loop once per possible filename
+      // length, which overflows bpf_log_buf even when the program is accepted.
+      // With log_level 0, bcc only asks for the log to explain a failure.
+      returnProgFd = bpf_prog_load(
+          progType, prog_name_for_kretprobe, trace_return_insns,
+          /* prog_len */ numTraceReturnInstructions * sizeof(struct bpf_insn),
+          /* license */ "GPL", kern_version,
+          /* log_level */ 0, bpf_log_buf, LOG_BUF_SIZE);
+      if (returnProgFd == -1) {
+        perror("Error calling bpf_prog_load() for kretprobe");
+        goto error;
+      }
+
+      // A single trace_return is enough, as the return value is at the same
+      // offset for every attach point, and the origin was saved by trace_entry.
+      for (int i = 0; i < numAttachPoints; i++) {
+        const struct attach_point *point = &attachPoints[i];
+        if (entryProbeFds[i] == -1) {
+          continue;
+        }
+        char eventName[EVENT_NAME_LEN];
+        if (opt_attach == ATTACH_KPROBE) {
+          eventNameFor("r_", point, eventName);
+          returnProbeFds[i] =
+              bpf_attach_kprobe(returnProgFd, BPF_PROBE_RETURN, eventName,
+                                point->name, /* fn_offset */ 0);
+        } else {
+          eventNameFor("sys_exit_", point, eventName);
+          returnProbeFds[i] =
+              bpf_attach_tracepoint(returnProgFd, "syscalls", eventName);
+        }
+        if (returnProbeFds[i] < 0) {
+          fprintf(stderr, "Error attaching trace_return to %s: %s\n",
+                  point->name, strerror(errno));
+          goto error;
+        }
+      }
+    }
+  }
+
+  // Only now is it known which attach points the origins refer to.
+  if (numOrigins > 1) {
+    eventFlags |= CAPTURE_FLAG_ORIGIN;
+  }
+  if (opt_write != NULL) {
+    capture = captureOpen(opt_write, eventFlags, opt_sample, originNames,
+                          numOrigins, opt_flush);
+    if (capture == NULL) {
+      fprintf(stderr, "Error creating capture file %s: %s\n", opt_write,
+              strerror(errno));
+      goto error;
+    }
+  }
+
+  if (opt_ringbuf) {
+    ringbuf = ringbufReaderNew(eventsMapFd, RINGBUF_PAGE_CNT * pageSize,
+                               &perf_reader_raw_callback,
+                               /* cb_cookie */ &buffers[0]);
+    if (ringbuf == NULL) {
+      perror("Error mapping the ring buffer");
+      goto error;
+    }
   }
 
   // Open a perf buffer for each online CPU.
   // (This is what open_perf_buffer() in bcc/table.py does.)
-  for (int cpuIndex = 0; cpuIndex < numCpu; cpuIndex++) {
+  for (int i = 0; i < numConsumers; i++) {
+    consumers[i].eventsMapFd = eventsMapFd;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &consumers[i].lastAdaptTime);
+  }
+  for (int cpuIndex = 0; !opt_ringbuf && sendsEvents() && cpuIndex < numCpu;
+       cpuIndex++) {
     int cpu = cpus[cpuIndex];
-    void *reader = bpf_open_perf_buffer(&perf_reader_raw_callback,
-                                        /* lost_cb */ NULL,
-                                        /* cb_cookie */ NULL,
-                                        /* pid */ -1, cpu,
-                                        /* page_cnt */ 64);
+    struct perf_reader *reader = openCpuBuffer(&buffers[cpuIndex]);
     if (reader == NULL) {
-      fprintf(stderr, "Error calling bpf_open_perf_buffer().\n");
+      perror("Error opening perf buffer");
       goto error;
     }
 
     // The fd is owned by the reader, which will be cleaned up by
     // perf_reader_free().
-    int perfReaderFd = perf_reader_fd((struct perf_reader *)reader);
-    readers[cpu] = reader;
+    int perfReaderFd = perf_reader_fd(reader);
+    readers[cpuIndex] = reader;
 
     int rc = bpf_update_elem(eventsMapFd, &cpu, &perfReaderFd, BPF_ANY);
     if (rc < 0) {
@@ -409,8 +2977,12 @@ int main(int argc, char **argv) {
     }
   }
 
-  struct timespec currentTime, endTime;
+  struct timespec startTime, currentTime, endTime;
   long long targetTimeNs;
+  if (clock_gettime(CLOCK_MONOTONIC, &startTime) < 0) {
+    perror("Error calling clock_gettime()");
+    goto error;
+  }
   if (opt_duration != -1) {
     if (clock_gettime(CLOCK_MONOTONIC_COARSE, &endTime) < 0) {
       perror("Error calling clock_gettime()");
@@ -420,10 +2992,59 @@ int main(int argc, char **argv) {
     endTime.tv_sec += opt_duration;
   }
 
-  printHeader();
+  if (!sendsEvents()) {
+    int rc;
+    if (opt_aggregate != -1) {
+      rc = runIntervals(aggregatesMapFd, opt_aggregate,
+                        opt_duration != -1 ? &endTime : NULL, &dumpAggregates);
+    } else {
+      rc = runIntervals(latencyMapFd, opt_latency,
+                        opt_duration != -1 ? &endTime : NULL, &dumpLatency);
+    }
+    if (rc < 0) {
+      perror("Error reading the counts from the kernel");
+      goto error;
+    }
+    reportUpdateFailures(updateFailuresMapFd);
+    exitCode = 0;
+    goto cleanup;
+  }
+
+  // The events bypass stdio, so the header must be written out before them.
+  if (capture == NULL) {
+    printHeader(opt_sample);
+    fflush(stdout);
+  }
+  if (opt_threads != 0) {
+    for (; numStartedConsumers < numConsumers; numStartedConsumers++) {
+      struct consumer *consumer = &consumers[numStartedConsumers];
+      int rc = pthread_create(&consumer->thread, /* attr */ NULL,
+                              &consumerThread, consumer);
+      if (rc != 0) {
+        fprintf(stderr, "Error calling pthread_create(): %s\n", strerror(rc));
+        goto error;
+      }
+    }
+
+    // Without -d, the consumers never return, so this blocks forever.
+    // (clock_nanosleep() does not accept CLOCK_MONOTONIC_COARSE, but it
+    // shares its epoch with CLOCK_MONOTONIC.)
+    if (opt_duration != -1) {
+      int rc;
+      do {
+        rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &endTime,
+                             /* remain */ NULL);
+      } while (rc == EINTR);
+      __atomic_store_n(&stopConsumers, 1, __ATOMIC_RELAXED);
+    }
+    for (; numStartedConsumers > 0; numStartedConsumers--) {
+      pthread_join(consumers[numStartedConsumers - 1].thread, NULL);
+    }
+  }
+
   // Loop and call perf_buffer_poll(), which has the side-effect of calling
   // perf_reader_raw_callback() on new events.
-  while (1) {
+  while (opt_threads == 0) {
     if (opt_duration != -1) {
       if (clock_gettime(CLOCK_MONOTONIC_COARSE, &currentTime) < 0) {
         perror("Error calling clock_gettime()");
@@ -437,13 +3058,72 @@ int main(int argc, char **argv) {
       }
     }
 
-    // From the implementation, this always appear to return 0.
-    int rc = perf_reader_poll(numCpu, readers, -1);
-    if (rc != 0) {
-      fprintf(stderr, "Unexpected return value from perf_reader_poll(): %d\n.",
-              rc);
+    if (opt_ringbuf) {
+      if (ringbufReaderPoll(ringbuf, getPollTimeout()) < 0) {
+        perror("Error polling the ring buffer");
+        goto error;
+      }
+      endBatch(&consumers[0]);
+      continue;
+    }
+
+    consumePerfBuffers(&consumers[0]);
+  }
+
+  // Summarize throughput and buffer memory so the perf buffer and ring buffer
+  // transports can be compared with the same workload.
+  if (clock_gettime(CLOCK_MONOTONIC, &currentTime) < 0) {
+    perror("Error calling clock_gettime()");
+    goto error;
+  }
+  double elapsed = (currentTime.tv_sec - startTime.tv_sec) +
+                   (currentTime.tv_nsec - startTime.tv_nsec) / 1e9;
+  unsigned long long numEvents = 0, numLost = 0;
+  size_t bufferBytes = 0;
+  for (int i = 0; i < numConsumers; i++) {
+    outputFlush(&consumers[i].out);
+  }
+  if (capture != NULL) {
+    int rc = 0;
+    for (int i = 0; i < numConsumers; i++) {
+      if (captureFlushBlock(capture, &consumers[i].block) < 0) {
+        rc = -1;
+      }
+    }
+    if (captureClose(capture) < 0) {
+      rc = -1;
+    }
+    capture = NULL;
+    if (rc < 0) {
+      perror("Error writing the capture file");
+      goto error;
+    }
+  }
+  for (int i = 0; i < (opt_ringbuf ? 1 : numCpu); i++) {
+    numEvents += buffers[i].numEvents;
+    numLost += buffers[i].numLost;
+    if (opt_ringbuf) {
+      // The consumer page, the producer page, and the data pages. (The second
+      // mapping of the data pages does not use any more memory.)
+      bufferBytes += (buffers[i].pageCnt + 2) * pageSize;
+    } else {
+      // Each perf buffer also has a header page.
+      bufferBytes += (buffers[i].pageCnt + 1) * pageSize;
+    }
+
+    if (buffers[i].numLost != 0 || opt_adaptive) {
+      fprintf(stderr, "CPU %d: %llu events, %llu lost, %d pages\n",
+              buffers[i].cpu, buffers[i].numEvents, buffers[i].numLost,
+              buffers[i].pageCnt);
     }
   }
+  fprintf(stderr,
+          "%llu events (%llu lost) in %.3f s (%.0f events/s), %zu KiB of %s "
+          "mapped\n",
+          numEvents, numLost, elapsed,
+          elapsed > 0 ? numEvents / elapsed : 0.0, bufferBytes / 1024,
+          opt_ringbuf ? "ring buffer" : "perf buffers");
+  reportUpdateFailures(updateFailuresMapFd);
 
   exitCode = 0;
   goto cleanup;
@@ -455,6 +3135,15 @@ error:
     fprintf(stderr, "%s", bpf_log_buf);
   }
 
+  // Consumer threads that were started before a failure.
+  if (numStartedConsumers > 0) {
+    __atomic_store_n(&stopConsumers, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < numStartedConsumers; i++) {
+      pthread_cancel(consumers[i].thread);
+      pthread_join(consumers[i].thread, NULL);
+    }
+  }
+
 cleanup:
   // readers
   if (readers != NULL) {
@@ -466,28 +3155,91 @@ cleanup:
     }
   }
 
-  // kprobe
-  if (kprobeFd != -1) {
-    close(kprobeFd);
-  }
-  if (entryProgFd != -1) {
-    close(entryProgFd);
+  if (ringbuf != NULL) {
+    ringbufReaderFree(ringbuf);
   }
 
-  // kretprobe
-  if (kretprobeFd != -1) {
-    close(kretprobeFd);
+  // kprobes or tracepoints
+  for (int i = 0; i < MAX_ATTACH_POINTS; i++) {
+    if (entryProbeFds[i] != -1) {
+      close(entryProbeFds[i]);
+    }
+    if (entryProgFds[i] != -1) {
+      close(entryProgFds[i]);
+    }
+    if (returnProbeFds[i] != -1) {
+      close(returnProbeFds[i]);
+    }
   }
   if (returnProgFd != -1) {
     close(returnProgFd);
   }
 
+  // fexit
+  for (int i = 0; i < MAX_ATTACH_POINTS; i++) {
+    if (exitProbeFds[i] != -1) {
+      close(exitProbeFds[i]);
+    }
+    if (exitProgFds[i] != -1) {
+      close(exitProgFds[i]);
+    }
+  }
+
   // maps
   if (eventsMapFd != -1) {
     close(eventsMapFd);
   }
-  if (hashMapFd != -1) {
-    close(hashMapFd);
+  if (infotmpMapFd != -1) {
+    close(infotmpMapFd);
+  }
+  if (commsMapFd != -1) {
+    close(commsMapFd);
+  }
+  if (aggregatesMapFd != -1) {
+    close(aggregatesMapFd);
+  }
+  if (latencyMapFd != -1) {
+    close(latencyMapFd);
+  }
+  if (updateFailuresMapFd != -1) {
+    close(updateFailuresMapFd);
+  }
+  if (scratchMapFd != -1) {
+    close(scratchMapFd);
+  }
+  if (pidsMapFd != -1) {
+    close(pidsMapFd);
+  }
+  if (cgroupsMapFd != -1) {
+    close(cgroupsMapFd);
+  }
+  if (prefixesMapFd != -1) {
+    close(prefixesMapFd);
+  }
+  if (dedupMapFd != -1) {
+    close(dedupMapFd);
+  }
+  if (pinnedPids) {
+    unlink(opt_pin_pids);
+  }
+
+  if (consumers != NULL) {
+    // Whatever was traced before an error is still worth seeing.
+    for (int i = 0; i < numConsumers; i++) {
+      outputFlush(&consumers[i].out);
+      outputFree(&consumers[i].out);
+      if (capture != NULL) {
+        captureFlushBlock(capture, &consumers[i].block);
+      }
+      captureBlockFree(&consumers[i].block);
+    }
+    free(consumers);
+  }
+  if (capture != NULL) {
+    captureClose(capture);
+  }
+  if (buffers != NULL) {
+    free(buffers);
   }
 
   // cpus array allocated by getOnlineCpus().
@@ -499,6 +3251,9 @@ cleanup:
   if (opt_name != NULL) {
     free(opt_name);
   }
+  if (opt_filter != NULL) {
+    filterFree(opt_filter);
+  }
 
   return exitCode;
 }
@@ -1,6 +1,6 @@
 /**
  * This header contains definitions that are shared with
- * opensnoop.c and opensnoop.py.
+ * opensnoop.c and programs.cc.
  */
 
 // This seems like it should be in <linux/sched.h>,
@@ -11,17 +11,133 @@
 #endif
 
 #define NAME_MAX 255
+#define PATH_MAX 4096
+
+// Size of data_t.fname, for --long-paths. Like NAME_MAX, it is one less than a
+// power of two, so trace_return also uses it as a mask to show the verifier
+// that the record size is bounded.
+#define LONG_FNAME_MAX (PATH_MAX - 1)
+
+// Default number of opens that can be in progress at once (see --max-inflight).
+#define DEFAULT_MAX_INFLIGHT 10240
 
 struct val_t {
   unsigned long long id;
   char comm[TASK_COMM_LEN];
   const char *fname;
+  // When the open started, for the event timestamp and for --latency.
+  unsigned long long ts;
+  // Index of the attach point that saw the open (see data_t.origin).
+  unsigned int origin;
 };
 
+/**
+ * Events are variable-length: only the part of fname up to and including its
+ * NUL terminator is sent to userspace, so a record is DATA_T_HEADER_SIZE bytes
+ * plus the length of the filename.
+ */
 struct data_t {
   unsigned long long id;
+  // When the open started (val_t.ts), in bpf_ktime_get_ns() time.
   unsigned long long ts;
   int ret;
+  // With --dedup, how many opens of fname by the same process were only
+  // counted since the previous record for them.
+  unsigned int repeats;
+  // Index of the attach point that the open came through, out of the
+  // functions or syscalls given to --attach-to.
+  unsigned int origin;
   char comm[TASK_COMM_LEN];
+  // At most NAME_MAX bytes are filled in unless --long-paths is given.
+  char fname[LONG_FNAME_MAX];
+};
+
+#define DATA_T_HEADER_SIZE __builtin_offsetof(struct data_t, fname)
+
+// Maximum number of functions or syscalls to attach to (see --attach-to).
+#define MAX_ATTACH_POINTS 16
+
+// Maximum number of PIDs or TIDs to trace with -p or -t.
+#define MAX_PIDS 16384
+
+// Maximum number of -p or -t options (each of which can list many IDs).
+#define MAX_ID_ARGS 64
+
+// Maximum number of --cgroup options.
+#define MAX_CGROUPS 64
+
+// Maximum number of --comm options.
+#define MAX_COMMS 64
+
+/**
+ * Key of the comms LPM trie for --comm. Processes are looked up with their
+ * whole comm, which bpf_get_current_comm() pads with NULs, so a name that is
+ * inserted with its NUL terminator matches exactly and one that is inserted
+ * without it matches as a prefix.
+ */
+struct comm_key {
+  unsigned int prefixlen;
+  char comm[TASK_COMM_LEN];
+};
+
+// Maximum number of --prefix options.
+#define MAX_PREFIXES 64
+
+// Maximum length of a --prefix argument.
+#define MAX_PREFIX_LEN 128
+
+/**
+ * Key of the prefixes LPM trie for --prefix. Filenames are looked up with
+ * their first MAX_PREFIX_LEN bytes, and prefixes are inserted without their NUL
+ * terminator, so they match any filename that starts with them.
+ */
+struct prefix_key {
+  unsigned int prefixlen;
+  char path[MAX_PREFIX_LEN];
+};
+
+// Number of (process, filename) pairs that --dedup keeps track of. The least
+// recently seen ones are forgotten beyond that.
+#define MAX_DEDUP_KEYS 10240
+
+/**
+ * Value of the dedup LRU hash for --dedup, which is keyed by a hash of the PID
+ * and the filename.
+ */
+struct dedup_val {
+  // When the last record for the pair was sent (val_t.ts).
+  unsigned long long ts;
+  // How many opens have been suppressed since then.
+  unsigned int repeats;
+};
+
+// Maximum number of distinct aggregate_keys per --aggregate interval.
+#define MAX_AGGREGATES 10240
+
+/**
+ * Key of the aggregates hash for --aggregate, which counts opens. The key is
+ * zeroed before it is filled in, so the bytes after the NUL terminator of
+ * fname do not make otherwise equal keys differ.
+ */
+struct aggregate_key {
+  char comm[TASK_COMM_LEN];
+  // errno, or 0 for a successful open.
+  int err;
   char fname[NAME_MAX];
 };
+
+// Maximum number of (comm, slot) pairs per --latency interval.
+#define MAX_LATENCY_KEYS 10240
+
+// Number of log2 slots of a histogram, which covers any 64-bit latency.
+#define MAX_LATENCY_SLOTS 65
+
+/**
+ * Key of the latency histogram for --latency. The histogram is always kept
+ * per comm, and opensnoop.c adds the comms up unless --per-comm is given.
+ */
+struct latency_key {
+  char comm[TASK_COMM_LEN];
+  // bpf_log2l() of the latency in microseconds.
+  unsigned long long slot;
+};
@@ -0,0 +1,160 @@
+#include "output.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int outputInit(struct output *out, int fd, enum output_flush_policy policy,
+               size_t cap) {
+  out->fd = fd;
+  out->policy = policy;
+  out->len = 0;
+  out->cap = cap;
+  out->buf = malloc(cap);
+  return out->buf == NULL ? -1 : 0;
+}
+
+void outputFree(struct output *out) {
+  free(out->buf);
+  out->buf = NULL;
+}
+
+// Held around the write(2) calls of a flush. Each consumer only formats into
+// its own buffer, but they all write to the same stdout, and write(2) is only
+// atomic up to PIPE_BUF bytes on a pipe: a larger write can be split and mixed
+// with that of another consumer, tearing lines apart.
+static pthread_mutex_t writeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+int outputFlush(struct output *out) {
+  int savedErrno = 0;
+  size_t written = 0;
+  pthread_mutex_lock(&writeMutex);
+  while (written < out->len) {
+    ssize_t n = write(out->fd, out->buf + written, out->len - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      savedErrno = errno;
+      break;
+    }
+    written += n;
+  }
+  pthread_mutex_unlock(&writeMutex);
+
+  out->len = 0;
+  if (savedErrno != 0) {
+    errno = savedErrno;
+    return -1;
+  }
+  return 0;
+}
+
+void outputReserve(struct output *out, size_t n) {
+  if (out->cap - out->len < n) {
+    // There is nowhere to report an error to from the middle of a line, and
+    // stdio would not have reported it either.
+    outputFlush(out);
+  }
+}
+
+void outputEndLine(struct output *out) {
+  out->buf[out->len++] = '\n';
+  if (out->policy == OUTPUT_FLUSH_LINE) {
+    outputFlush(out);
+  }
+}
+
+void outputEndBatch(struct output *out) {
+  if (out->policy == OUTPUT_FLUSH_BATCH && out->len > 0) {
+    outputFlush(out);
+  }
+}
+
+/**
+ * Appends len bytes from str after padding them to width.
+ */
+static void appendPadded(struct output *out, const char *str, size_t len,
+                         int width) {
+  size_t padding = 0;
+  int leftJustify = width < 0;
+  size_t absWidth = leftJustify ? -width : width;
+  if (len < absWidth) {
+    padding = absWidth - len;
+  }
+
+  if (!leftJustify) {
+    memset(out->buf + out->len, ' ', padding);
+    out->len += padding;
+  }
+  memcpy(out->buf + out->len, str, len);
+  out->len += len;
+  if (leftJustify) {
+    memset(out->buf + out->len, ' ', padding);
+    out->len += padding;
+  }
+}
+
+void outputAppendString(struct output *out, const char *str, size_t len,
+                        int width) {
+  appendPadded(out, str, len, width);
+}
+
+/**
+ * Formats value into the end of digits (which must have room for 20
+ * characters) and returns a pointer to the first character. If minDigits is
+ * greater than the number of digits, the result is padded with zeros.
+ */
+static char *formatUnsigned(unsigned long long value, int minDigits,
+                            char *digitsEnd) {
+  char *p = digitsEnd;
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+    minDigits--;
+  } while (value != 0 || minDigits > 0);
+  return p;
+}
+
+void outputAppendInt(struct output *out, long long value, int width) {
+  // Room for the sign and the 20 digits of the largest 64-bit value.
+  char digits[21];
+  char *end = digits + sizeof(digits);
+  unsigned long long magnitude =
+      value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+  char *p = formatUnsigned(magnitude, 1, end);
+  if (value < 0) {
+    *--p = '-';
+  }
+  appendPadded(out, p, end - p, width);
+}
+
+void outputAppendFixed(struct output *out, long long value, int decimals,
+                       int width) {
+  unsigned long long scale = 1;
+  for (int i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+
+  unsigned long long magnitude =
+      value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+
+  // Room for the sign, 20 digits, and the decimal point.
+  char digits[22];
+  char *end = digits + sizeof(digits);
+  char *p = end;
+  if (decimals > 0) {
+    p = formatUnsigned(magnitude % scale, decimals, end);
+    *--p = '.';
+  }
+  p = formatUnsigned(magnitude / scale, 1, p);
+  if (value < 0) {
+    *--p = '-';
+  }
+  appendPadded(out, p, end - p, width);
+}
+
+void outputAppendChar(struct output *out, char c) {
+  out->buf[out->len++] = c;
+}
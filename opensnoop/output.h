@@ -0,0 +1,86 @@
+/**
+ * A minimal replacement for stdio for writing opensnoop's output. Each
+ * consumer thread formats lines into its own large buffer without any locking
+ * or format string parsing, and the buffer is handed to write(2) in one go
+ * according to the flush policy.
+ */
+#pragma once
+
+#include <stddef.h>
+
+// Upper bound on the length of one line of output, which is what callers
+// pass to outputReserve() before formatting a line. It leaves room for a
+// filename of almost PATH_MAX bytes from --long-paths.
+#define OUTPUT_MAX_LINE 4608
+
+// Default capacity of an output buffer.
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+enum output_flush_policy {
+  // Write after every line, like a line-buffered stdout.
+  OUTPUT_FLUSH_LINE,
+  // Write after each batch of events drained by a consumer. Output lags behind
+  // the events by at most one wakeup, which is what interactive use needs.
+  OUTPUT_FLUSH_BATCH,
+  // Only write when the buffer is full (and at exit).
+  OUTPUT_FLUSH_FULL,
+};
+
+struct output {
+  int fd;
+  enum output_flush_policy policy;
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/**
+ * Returns 0 on success or -1 with errno set.
+ */
+int outputInit(struct output *out, int fd, enum output_flush_policy policy,
+               size_t cap);
+
+void outputFree(struct output *out);
+
+/**
+ * Writes out everything that is buffered, holding a lock that is shared by all
+ * outputs so that the writes of different threads do not get mixed. Returns 0
+ * on success or -1 with errno set, in which case the buffered data is
+ * discarded.
+ */
+int outputFlush(struct output *out);
+
+/**
+ * Makes sure at least n bytes can be appended, flushing if necessary. The
+ * outputAppend*() functions do not check for space themselves, so they must
+ * be preceded by a call to this.
+ */
+void outputReserve(struct output *out, size_t n);
+
+/**
+ * To be called at the end of a line and at the end of a batch, respectively,
+ * so the buffer is flushed according to the policy.
+ */
+void outputEndLine(struct output *out);
+void outputEndBatch(struct output *out);
+
+/**
+ * Appends str, padded with spaces to width. A negative width pads on the
+ * right (left-justifies), like "%-*s".
+ */
+void outputAppendString(struct output *out, const char *str, size_t len,
+                        int width);
+
+/**
+ * Appends value in decimal, padded to width like outputAppendString().
+ */
+void outputAppendInt(struct output *out, long long value, int width);
+
+/**
+ * Appends value / 10^decimals in fixed-point notation with exactly decimals
+ * digits after the point, padded to width like outputAppendString().
+ */
+void outputAppendFixed(struct output *out, long long value, int decimals,
+                       int width);
+
+void outputAppendChar(struct output *out, char c);
@@ -0,0 +1,924 @@
+/**
+ * The BPF programs that opensnoop loads, written with the assembler in
+ * bpf_assembler.hpp. Each program is a function template of its program_flags,
+ * so every variant is assembled at compile time, and assembleProgram() only has
+ * to copy the one that the command line asks for and fill in its parameters.
+ *
+ * Above each program is the C that it is equivalent to. The register and
+ * stack slot assignments are what clang picked for that C, which the verifier
+ * is known to accept.
+ */
+#include "programs.h"
+#include "bpf_assembler.hpp"
+#include "opensnoop.h"
+#include <cerrno>
+#include <cstddef>
+#include <utility>
+
+namespace {
+
+using namespace bpf;
+using Assembler = bpf::Assembler<program_args>;
+using Param = bpf::Param<program_args>;
+
+constexpr Param filenameOffset{&program_args::filenameOffset};
+constexpr Param retOffset{&program_args::retOffset};
+constexpr Param origin{&program_args::origin};
+constexpr Param fnameSize{&program_args::fnameSize};
+constexpr Param sample{&program_args::sample};
+constexpr Param watermark{&program_args::watermark};
+constexpr Param dedupWindow{&program_args::dedupWindow};
+constexpr Param infotmpMap{&program_args::infotmpMapFd};
+constexpr Param eventsMap{&program_args::eventsMapFd};
+constexpr Param commsMap{&program_args::commsMapFd};
+constexpr Param aggregatesMap{&program_args::aggregatesMapFd};
+constexpr Param latencyMap{&program_args::latencyMapFd};
+constexpr Param updateFailuresMap{&program_args::updateFailuresMapFd};
+constexpr Param scratchMap{&program_args::scratchMapFd};
+constexpr Param pidsMap{&program_args::pidsMapFd};
+constexpr Param cgroupsMap{&program_args::cgroupsMapFd};
+constexpr Param prefixesMap{&program_args::prefixesMapFd};
+constexpr Param dedupMap{&program_args::dedupMapFd};
+
+// The offsets and sizes of the structs that the programs build, which are
+// small enough for the off of an instruction, and signed so that they can be
+// added to negative stack offsets.
+#define OFFSET(type, member) ((int16_t)offsetof(type, member))
+#define SIZE(type) ((int16_t)sizeof(type))
+#define VAL(member) OFFSET(struct val_t, member)
+#define DATA(member) OFFSET(struct data_t, member)
+
+// Where trace_entry builds its val_t on the stack.
+constexpr int16_t ENTRY_VAL = -SIZE(struct val_t);
+
+/**
+ * r0 = the infotmp task storage of the current task, which is created if
+ * create is set and it does not exist yet, or NULL.
+ *
+ * The storage is reused by the next open of the task instead of being deleted,
+ * and a ts of 0 marks it as not in flight.
+ */
+constexpr void getTaskStorage(Assembler &a, bool create) {
+  a.call(BPF_FUNC_get_current_task_btf);
+  a.mov(r2, r0);
+  a.loadMap(r1, infotmpMap);
+  a.mov(r3, 0);
+  a.mov(r4, create ? BPF_LOCAL_STORAGE_GET_F_CREATE : 0);
+  a.call(BPF_FUNC_task_storage_get);
+}
+
+/**
+ * Looks up the key at r10 + key in the set in map, and goes to miss if it is
+ * not there.
+ */
+constexpr void checkInSet(Assembler &a, Param map, int16_t key, Label miss) {
+  a.loadMap(r1, map);
+  a.mov(r2, r10);
+  a.add(r2, key);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.jeq(r0, 0, miss);
+}
+
+/**
+ * trace_entry, which is attached where the open starts:
+ *
+ *   const char *filename = CTX_FIELD(filenameOffset);
+ *   struct val_t val = {};
+ *   u64 id = bpf_get_current_pid_tgid();
+ *   u32 pid = id >> 32;
+ *   u32 tid = id;
+ *
+ *   // PROGRAM_TIDS, PROGRAM_PIDS, or PROGRAM_CGROUPS
+ *   if (pids.lookup(&tid) == 0) return 0;
+ *   if (pids.lookup(&pid) == 0) return 0;
+ *   u64 cgroup = bpf_get_current_cgroup_id();
+ *   if (cgroups.lookup(&cgroup) == 0) return 0;
+ *   // PROGRAM_SAMPLED
+ *   if (bpf_get_prandom_u32() % sample != 0) return 0;
+ *   if (bpf_get_current_comm(&val.comm, sizeof(val.comm)) == 0) {
+ *     // PROGRAM_COMMS: other processes never touch infotmp, so trace_return
+ *     // drops them after a single failed lookup.
+ *     struct comm_key key = {.prefixlen = sizeof(key.comm) * 8};
+ *     __builtin_memcpy(&key.comm, &val.comm, sizeof(key.comm));
+ *     if (comms.lookup(&key) == 0) return 0;
+ *     val.ts = bpf_ktime_get_ns();
+ *     val.id = id;
+ *     val.fname = filename;
+ *     val.origin = origin;
+ *     // infotmp evicts the oldest entries (such as those whose kretprobe
+ *     // never fired) when it is full, so this should only fail when the
+ *     // eviction cannot keep up, or with task storage, when it cannot be
+ *     // allocated.
+ *     if (infotmp.update(&id, &val) != 0) {
+ *       update_failures.atomic_increment(0);
+ *     }
+ *   }
+ *   return 0;
+ */
+template <unsigned Flags> constexpr Assembler traceEntry() {
+  constexpr bool task = Flags & PROGRAM_TASK_STORAGE;
+  constexpr int16_t idKey = -56, pidKey = -88, cgroupKey = -96, commKey = -80,
+                    updateFailuresKey = -84;
+  Assembler a;
+  Label out = a.newLabel();
+
+  a.load(Size::DW, r7, r1, filenameOffset);
+  a.mov(r1, 0);
+  for (int16_t off = ENTRY_VAL + SIZE(struct val_t) - 8; off >= ENTRY_VAL;
+       off -= 8) {
+    a.store(Size::DW, r10, off, r1);
+  }
+  a.call(BPF_FUNC_get_current_pid_tgid);
+  a.mov(r6, r0);
+  if constexpr (!task) {
+    a.store(Size::DW, r10, idKey, r6);
+  }
+
+  if constexpr (Flags & PROGRAM_TIDS) {
+    a.store(Size::W, r10, pidKey, r6);
+    checkInSet(a, pidsMap, pidKey, out);
+  } else if constexpr (Flags & PROGRAM_PIDS) {
+    a.mov(r1, r6);
+    a.rsh(r1, 32);
+    a.store(Size::W, r10, pidKey, r1);
+    checkInSet(a, pidsMap, pidKey, out);
+  } else if constexpr (Flags & PROGRAM_CGROUPS) {
+    a.call(BPF_FUNC_get_current_cgroup_id);
+    a.store(Size::DW, r10, cgroupKey, r0);
+    checkInSet(a, cgroupsMap, cgroupKey, out);
+  }
+
+  if constexpr (Flags & PROGRAM_SAMPLED) {
+    a.call(BPF_FUNC_get_prandom_u32);
+    a.lsh(r0, 32);
+    a.rsh(r0, 32);
+    a.mod(r0, sample);
+    a.jne(r0, 0, out);
+  }
+
+  a.mov(r1, r10);
+  a.add(r1, ENTRY_VAL + VAL(comm));
+  a.mov(r2, TASK_COMM_LEN);
+  a.call(BPF_FUNC_get_current_comm);
+  a.lsh(r0, 32);
+  a.rsh(r0, 32);
+  a.jne(r0, 0, out);
+
+  if constexpr (Flags & PROGRAM_COMMS) {
+    a.mov(r1, TASK_COMM_LEN * 8);
+    a.store(Size::W, r10, commKey, r1);
+    for (int16_t off = 0; off < TASK_COMM_LEN; off += 4) {
+      a.load(Size::W, r1, r10, ENTRY_VAL + VAL(comm) + off);
+      a.store(Size::W, r10, commKey + OFFSET(struct comm_key, comm) + off,
+              r1);
+    }
+    checkInSet(a, commsMap, commKey, out);
+  }
+
+  a.call(BPF_FUNC_ktime_get_ns);
+  a.store(Size::DW, r10, ENTRY_VAL + VAL(ts), r0);
+  a.store(Size::DW, r10, ENTRY_VAL + VAL(fname), r7);
+  a.store(Size::DW, r10, ENTRY_VAL + VAL(id), r6);
+  a.mov(r1, origin);
+  a.store(Size::W, r10, ENTRY_VAL + VAL(origin), r1);
+
+  if constexpr (task) {
+    Label failed = a.newLabel();
+    getTaskStorage(a, true);
+    a.jeq(r0, 0, failed);
+    for (int16_t off = 0; off < SIZE(struct val_t); off += 8) {
+      a.load(Size::DW, r1, r10, ENTRY_VAL + off);
+      a.store(Size::DW, r0, off, r1);
+    }
+    a.ja(out);
+    a.bind(failed);
+  } else {
+    a.loadMap(r1, infotmpMap);
+    a.mov(r2, r10);
+    a.add(r2, idKey);
+    a.mov(r3, r10);
+    a.add(r3, ENTRY_VAL);
+    a.mov(r4, BPF_ANY);
+    a.call(BPF_FUNC_map_update_elem);
+    a.lsh(r0, 32);
+    a.rsh(r0, 32);
+    a.jeq(r0, 0, out);
+  }
+
+  a.mov(r1, 0);
+  a.store(Size::W, r10, updateFailuresKey, r1);
+  a.loadMap(r1, updateFailuresMap);
+  a.mov(r2, r10);
+  a.add(r2, updateFailuresKey);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.jeq(r0, 0, out);
+  a.mov(r1, 1);
+  a.atomicAdd(Size::DW, r0, 0, r1);
+
+  a.bind(out);
+  a.mov(r0, 0);
+  a.exit();
+  return a;
+}
+
+// Where the trace_return programs keep the pid_tgid key of infotmp.
+constexpr int16_t RETURN_ID_KEY = -8;
+
+/**
+ * The start of every trace_return program, which sets r6 to the context and
+ * valp to the val_t that trace_entry saved, and goes to out if there is none.
+ *
+ *   u64 id = bpf_get_current_pid_tgid();
+ *   // PROGRAM_FAILED: successful opens are dropped before anything is read or
+ *   // submitted. The infotmp entry from trace_entry still has to go.
+ *   if ((int)CTX_FIELD(retOffset) >= 0) goto delete;
+ *   // PROGRAM_FILTERED: so must the entries of the opens that --filter drops.
+ *   if (filtered) goto delete;
+ *   struct val_t *valp = infotmp.lookup(&id);
+ *   if (valp == 0) return 0;
+ */
+template <unsigned Flags>
+constexpr void lookupInfotmp(Assembler &a, Reg valp, Label remove, Label out) {
+  a.mov(r6, r1);
+  if constexpr (!(Flags & PROGRAM_TASK_STORAGE)) {
+    a.call(BPF_FUNC_get_current_pid_tgid);
+    a.store(Size::DW, r10, RETURN_ID_KEY, r0);
+  }
+  if constexpr (Flags & PROGRAM_FAILED) {
+    a.load(Size::DW, r1, r6, retOffset);
+    a.lsh(r1, 32);
+    a.arsh(r1, 32);
+    a.jsgt(r1, -1, remove);
+  }
+  if constexpr (Flags & PROGRAM_FILTERED) {
+    a.jne(r9, 0, remove);
+  }
+  if constexpr (Flags & PROGRAM_TASK_STORAGE) {
+    getTaskStorage(a, false);
+    a.mov(valp, r0);
+    a.jeq(valp, 0, out);
+    a.load(Size::DW, r1, valp, VAL(ts));
+    a.jeq(r1, 0, out);
+  } else {
+    a.loadMap(r1, infotmpMap);
+    a.mov(r2, r10);
+    a.add(r2, RETURN_ID_KEY);
+    a.call(BPF_FUNC_map_lookup_elem);
+    a.mov(valp, r0);
+    a.jeq(valp, 0, out);
+  }
+}
+
+/**
+ * The end of every trace_return program, where remove and out are bound:
+ *
+ *   delete:
+ *   infotmp.delete(&id);
+ *   return 0;
+ */
+template <unsigned Flags>
+constexpr void deleteInfotmp(Assembler &a, Label remove, Label out) {
+  a.bind(remove);
+  if constexpr (Flags & PROGRAM_TASK_STORAGE) {
+    getTaskStorage(a, false);
+    a.jeq(r0, 0, out);
+    a.mov(r1, 0);
+    a.store(Size::DW, r0, VAL(ts), r1);
+  } else {
+    a.loadMap(r1, infotmpMap);
+    a.mov(r2, r10);
+    a.add(r2, RETURN_ID_KEY);
+    a.call(BPF_FUNC_map_delete_elem);
+  }
+  a.bind(out);
+  a.mov(r0, 0);
+  a.exit();
+}
+
+/**
+ * PROGRAM_PREFIXES, with the filename that was just read at r3 + path:
+ *
+ *   struct prefix_key prefix = {.prefixlen = sizeof(prefix.path) * 8};
+ *   bpf_probe_read(&prefix.path, sizeof(prefix.path), path);
+ *   if (prefixes.lookup(&prefix) == 0) goto delete;
+ *
+ * The trie does the comparison: the key is the first MAX_PREFIX_LEN bytes of
+ * the filename, and as no prefix contains a NUL, a shorter filename cannot
+ * match one that is longer than it, whatever follows its NUL terminator.
+ */
+constexpr void checkPrefix(Assembler &a, int16_t key, Reg base, int16_t path,
+                           Label remove) {
+  a.mov(r1, MAX_PREFIX_LEN * 8);
+  a.store(Size::W, r10, key, r1);
+  a.mov(r1, r10);
+  a.add(r1, key + OFFSET(struct prefix_key, path));
+  a.mov(r2, MAX_PREFIX_LEN);
+  a.mov(r3, base);
+  a.add(r3, path);
+  a.call(BPF_FUNC_probe_read);
+  checkInSet(a, prefixesMap, key, remove);
+}
+
+/**
+ * Sends the record of size r9 + DATA_T_HEADER_SIZE at r7, with r6 the
+ * context:
+ *
+ *   events.perf_submit(ctx, data, size);
+ *   // PROGRAM_RINGBUF: records are variable-length, which ringbuf_reserve()
+ *   // cannot do, so the record is still built in the scratch slot and then
+ *   // copied.
+ *   ringbuf.ringbuf_output(data, size, 0);
+ *   // PROGRAM_BATCHED: only wake the consumer up once the unconsumed data in
+ *   // the ring buffer reaches the watermark, so it can drain a whole batch
+ *   // per wakeup.
+ *   u64 flags = ringbuf.ringbuf_query(BPF_RB_AVAIL_DATA) >= watermark
+ *                   ? BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP;
+ *   ringbuf.ringbuf_output(data, size, flags);
+ */
+template <unsigned Flags> constexpr void submitRecord(Assembler &a) {
+  if constexpr (Flags & PROGRAM_BATCHED) {
+    Label noWakeup = a.newLabel();
+    a.loadMap(r1, eventsMap);
+    a.mov(r2, BPF_RB_AVAIL_DATA);
+    a.call(BPF_FUNC_ringbuf_query);
+    a.mov(r4, BPF_RB_NO_WAKEUP);
+    a.jlt(r0, watermark, noWakeup);
+    a.mov(r4, BPF_RB_FORCE_WAKEUP);
+    a.bind(noWakeup);
+    a.loadMap(r1, eventsMap);
+    a.mov(r2, r7);
+    a.mov(r3, r9);
+    a.add(r3, DATA_T_HEADER_SIZE);
+    a.call(BPF_FUNC_ringbuf_output);
+  } else if constexpr (Flags & PROGRAM_RINGBUF) {
+    a.loadMap(r1, eventsMap);
+    a.mov(r2, r7);
+    a.mov(r3, r9);
+    a.add(r3, DATA_T_HEADER_SIZE);
+    a.mov(r4, 0);
+    a.call(BPF_FUNC_ringbuf_output);
+  } else {
+    a.mov(r5, r9);
+    a.add(r5, DATA_T_HEADER_SIZE);
+    a.mov(r1, r6);
+    a.loadMap(r2, eventsMap);
+    a.load64(r3, BPF_F_CURRENT_CPU);
+    a.mov(r4, r7);
+    a.call(BPF_FUNC_perf_event_output);
+  }
+}
+
+/**
+ * Reads the filename at r3 into the record at r7, and sets r9 to its length,
+ * including its NUL terminator, which is at least 1 even if it could not be
+ * read.
+ */
+constexpr void readFilename(Assembler &a) {
+  Label read = a.newLabel();
+  a.mov(r1, r7);
+  a.add(r1, DATA(fname));
+  a.mov(r2, fnameSize);
+  a.call(BPF_FUNC_probe_read_str);
+  a.mov(r9, r0);
+  a.jsgt(r9, 0, read);
+  a.mov(r9, 1);
+  a.bind(read);
+}
+
+/**
+ * PROGRAM_DEDUP: an open of a path that the same process already sent within
+ * the last dedupWindow milliseconds is only counted in the dedup map, and the
+ * next record sent for that pair carries the count. The key is a 64-bit FNV-1a
+ * hash of the PID and the filename, including its NUL terminator.
+ *
+ *   u64 hash = (0xcbf29ce484222325ULL ^ (valp->id >> 32)) * 0x100000001b3ULL;
+ *   for (u32 i = 0; i < len; i++) {
+ *     hash = (hash ^ (u8)data->fname[i]) * 0x100000001b3ULL;
+ *   }
+ *   struct dedup_val *seen = dedup.lookup(&hash);
+ *   if (seen != 0) {
+ *     if ((valp->ts - seen->ts) / 1000000 < dedupWindow) {
+ *       __sync_fetch_and_add(&seen->repeats, 1);
+ *       goto delete;
+ *     }
+ *     data->repeats = seen->repeats;
+ *   }
+ *   struct dedup_val first = {.ts = valp->ts};
+ *   dedup.update(&hash, &first);
+ */
+template <unsigned Flags>
+constexpr void checkDuplicate(Assembler &a, Label remove) {
+  constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL,
+                     FNV_PRIME = 0x100000001b3ULL;
+  constexpr int16_t hashKey = -24, first = -40;
+  Label hash = a.newLabel(), hashed = a.newLabel(), emit = a.newLabel(),
+        insert = a.newLabel();
+
+  a.load(Size::DW, r1, r8, VAL(id));
+  a.rsh(r1, 32);
+  a.load64(r2, FNV_OFFSET_BASIS);
+  a.bitXor(r1, r2);
+  a.load64(r2, FNV_PRIME);
+  a.mul(r1, r2);
+  a.mov(r3, 0);
+  a.bind(hash);
+  a.jge(r3, r9, hashed);
+  a.mov(r4, r7);
+  a.add(r4, r3);
+  a.load(Size::B, r5, r4, DATA(fname));
+  a.bitXor(r1, r5);
+  a.mul(r1, r2);
+  a.add(r3, 1);
+  a.ja(hash);
+  a.bind(hashed);
+  a.store(Size::DW, r10, hashKey, r1);
+
+  a.loadMap(r1, dedupMap);
+  a.mov(r2, r10);
+  a.add(r2, hashKey);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.jeq(r0, 0, insert);
+  a.load(Size::DW, r1, r8, VAL(ts));
+  a.load(Size::DW, r2, r0, OFFSET(struct dedup_val, ts));
+  a.sub(r1, r2);
+  a.div(r1, 1000000);
+  a.jge(r1, dedupWindow, emit);
+  a.mov(r1, 1);
+  a.atomicAdd(Size::W, r0, OFFSET(struct dedup_val, repeats), r1);
+  a.ja(remove);
+  a.bind(emit);
+  a.load(Size::W, r1, r0, OFFSET(struct dedup_val, repeats));
+  a.store(Size::W, r7, DATA(repeats), r1);
+
+  a.bind(insert);
+  a.load(Size::DW, r1, r8, VAL(ts));
+  a.store(Size::DW, r10, first + OFFSET(struct dedup_val, ts), r1);
+  a.mov(r1, 0);
+  a.store(Size::DW, r10, first + OFFSET(struct dedup_val, repeats), r1);
+  a.loadMap(r1, dedupMap);
+  a.mov(r2, r10);
+  a.add(r2, hashKey);
+  a.mov(r3, r10);
+  a.add(r3, first);
+  a.mov(r4, BPF_ANY);
+  a.call(BPF_FUNC_map_update_elem);
+}
+
+/**
+ * trace_return, which is attached where the open returns, and sends the open
+ * as an event:
+ *
+ *   (lookupInfotmp)
+ *   // data_t is too large for the BPF stack with a PATH_MAX fname, so the
+ *   // record is built in this CPU's scratch slot instead.
+ *   struct data_t *data = scratch.lookup(&zero);
+ *   if (data == 0) return 0;
+ *   bpf_probe_read(&data->comm, sizeof(data->comm), valp->comm);
+ *   // Only the part of fname that is filled in here (up to and including the
+ *   // NUL terminator) is submitted, so the rest of the slot can be left over
+ *   // from the previous record.
+ *   int len = bpf_probe_read_str(&data->fname, fnameSize, valp->fname);
+ *   if (len < 1) len = 1;
+ *   (checkPrefix on data->fname)
+ *   data->id = valp->id;
+ *   data->ts = valp->ts;
+ *   data->ret = CTX_FIELD(retOffset);
+ *   data->repeats = 0;
+ *   data->origin = valp->origin;
+ *   // len can never exceed fnameSize, but the verifier needs to see that the
+ *   // size passed to the helper is bounded.
+ *   len &= LONG_FNAME_MAX;
+ *   (checkDuplicate)
+ *   (submitRecord)
+ *   (deleteInfotmp)
+ */
+template <unsigned Flags> constexpr Assembler traceReturn() {
+  constexpr int16_t scratchKey = -12, prefixKey = -144;
+  Assembler a;
+  Label remove = a.newLabel(), out = a.newLabel();
+
+  lookupInfotmp<Flags>(a, r8, remove, out);
+  a.mov(r1, 0);
+  a.store(Size::W, r10, scratchKey, r1);
+  a.loadMap(r1, scratchMap);
+  a.mov(r2, r10);
+  a.add(r2, scratchKey);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.mov(r7, r0);
+  a.jeq(r7, 0, out);
+
+  a.mov(r3, r8);
+  a.add(r3, VAL(comm));
+  a.mov(r1, r7);
+  a.add(r1, DATA(comm));
+  a.mov(r2, TASK_COMM_LEN);
+  a.call(BPF_FUNC_probe_read);
+  a.load(Size::DW, r3, r8, VAL(fname));
+  readFilename(a);
+  if constexpr (Flags & PROGRAM_PREFIXES) {
+    checkPrefix(a, prefixKey, r7, DATA(fname), remove);
+  }
+  a.bitAnd(r9, LONG_FNAME_MAX);
+
+  a.load(Size::DW, r1, r8, VAL(id));
+  a.store(Size::DW, r7, DATA(id), r1);
+  a.load(Size::DW, r1, r8, VAL(ts));
+  a.store(Size::DW, r7, DATA(ts), r1);
+  a.load(Size::DW, r1, r6, retOffset);
+  a.store(Size::W, r7, DATA(ret), r1);
+  a.mov(r1, 0);
+  a.store(Size::W, r7, DATA(repeats), r1);
+  a.load(Size::W, r1, r8, VAL(origin));
+  a.store(Size::W, r7, DATA(origin), r1);
+
+  if constexpr (Flags & PROGRAM_DEDUP) {
+    checkDuplicate<Flags>(a, remove);
+  }
+  submitRecord<Flags>(a);
+  deleteInfotmp<Flags>(a, remove, out);
+  return a;
+}
+
+/**
+ * Adds 1 to the count at key in map, which is zero-initialized through the
+ * slot at r10 + zero if it is not there yet, and then goes to remove:
+ *
+ *   map.increment(key);
+ */
+constexpr void increment(Assembler &a, Param map, int16_t key, int16_t zero,
+                         Label remove) {
+  Label add = a.newLabel();
+  a.loadMap(r1, map);
+  a.mov(r2, r10);
+  a.add(r2, key);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.jne(r0, 0, add);
+  a.mov(r1, 0);
+  a.store(Size::DW, r10, zero, r1);
+  a.loadMap(r1, map);
+  a.mov(r2, r10);
+  a.add(r2, key);
+  a.mov(r3, r10);
+  a.add(r3, zero);
+  a.mov(r4, BPF_NOEXIST);
+  a.call(BPF_FUNC_map_update_elem);
+  checkInSet(a, map, key, remove);
+  a.bind(add);
+  a.mov(r1, 1);
+  a.atomicAdd(Size::DW, r0, 0, r1);
+}
+
+/**
+ * trace_return for PROGRAM_AGGREGATE, which counts opens in the kernel instead
+ * of sending them:
+ *
+ *   (lookupInfotmp)
+ *   struct aggregate_key key = {};
+ *   bpf_probe_read(&key.comm, sizeof(key.comm), valp->comm);
+ *   bpf_probe_read_str(&key.fname, sizeof(key.fname), valp->fname);
+ *   (checkPrefix on key.fname)
+ *   int ret = CTX_FIELD(retOffset);
+ *   key.err = ret < 0 ? -ret : 0;
+ *   aggregates.increment(key);
+ *   (deleteInfotmp)
+ */
+template <unsigned Flags> constexpr Assembler traceReturnAggregate() {
+  constexpr int16_t key = -288, zero = -296, prefixKey = -432;
+  Assembler a;
+  Label remove = a.newLabel(), out = a.newLabel(), success = a.newLabel();
+
+  lookupInfotmp<Flags>(a, r7, remove, out);
+  a.mov(r1, 0);
+  static_assert(sizeof(struct aggregate_key) % 8 == 4);
+  constexpr int16_t end = key + SIZE(struct aggregate_key);
+  for (int16_t off = key; off < end - 4; off += 8) {
+    a.store(Size::DW, r10, off, r1);
+  }
+  a.store(Size::W, r10, end - 4, r1);
+
+  a.mov(r3, r7);
+  a.add(r3, VAL(comm));
+  a.mov(r1, r10);
+  a.add(r1, key + OFFSET(struct aggregate_key, comm));
+  a.mov(r2, TASK_COMM_LEN);
+  a.call(BPF_FUNC_probe_read);
+  a.load(Size::DW, r3, r7, VAL(fname));
+  a.mov(r1, r10);
+  a.add(r1, key + OFFSET(struct aggregate_key, fname));
+  a.mov(r2, NAME_MAX);
+  a.call(BPF_FUNC_probe_read_str);
+  if constexpr (Flags & PROGRAM_PREFIXES) {
+    checkPrefix(a, prefixKey, r10, key + OFFSET(struct aggregate_key, fname),
+                remove);
+  }
+
+  a.load(Size::DW, r1, r6, retOffset);
+  a.lsh(r1, 32);
+  a.arsh(r1, 32);
+  a.mov(r2, 0);
+  a.jsgt(r1, -1, success);
+  a.sub(r2, r1);
+  a.bind(success);
+  a.store(Size::W, r10, key + OFFSET(struct aggregate_key, err), r2);
+  increment(a, aggregatesMap, key, zero, remove);
+  deleteInfotmp<Flags>(a, remove, out);
+  return a;
+}
+
+/**
+ * trace_return for PROGRAM_LATENCY, which only updates a histogram of how long
+ * opens take:
+ *
+ *   (lookupInfotmp)
+ *   struct latency_key key = {};
+ *   bpf_probe_read(&key.comm, sizeof(key.comm), valp->comm);
+ *   key.slot = bpf_log2l((bpf_ktime_get_ns() - valp->ts) / 1000);
+ *   latency.increment(key);
+ *   (deleteInfotmp)
+ */
+template <unsigned Flags> constexpr Assembler traceReturnLatency() {
+  constexpr int16_t key = -32, zero = -40;
+  Assembler a;
+  Label remove = a.newLabel(), out = a.newLabel(), log2 = a.newLabel();
+
+  lookupInfotmp<Flags>(a, r7, remove, out);
+  a.mov(r1, 0);
+  for (int16_t off = key + SIZE(struct latency_key) - 8; off >= key;
+       off -= 8) {
+    a.store(Size::DW, r10, off, r1);
+  }
+  a.mov(r3, r7);
+  a.add(r3, VAL(comm));
+  a.mov(r1, r10);
+  a.add(r1, key + OFFSET(struct latency_key, comm));
+  a.mov(r2, TASK_COMM_LEN);
+  a.call(BPF_FUNC_probe_read);
+
+  a.call(BPF_FUNC_ktime_get_ns);
+  a.load(Size::DW, r1, r7, VAL(ts));
+  a.sub(r0, r1);
+  a.div(r0, 1000);
+
+  // bpf_log2l(r0) into r2: 1 + the index of the highest bit set, or 1 for 0
+  // and 1, found in the upper or lower half and then by binary search.
+  a.mov(r1, r0);
+  a.rsh(r1, 32);
+  a.mov(r2, 33);
+  a.jne(r1, 0, log2);
+  a.mov(r1, r0);
+  a.lsh(r1, 32);
+  a.rsh(r1, 32);
+  a.mov(r2, 1);
+  a.bind(log2);
+  a.mov(r3, 0);
+  for (int bits = 16; bits > 1; bits /= 2) {
+    Label lower = a.newLabel();
+    a.jle(r1, (1 << bits) - 1, lower);
+    if (bits == 16) {
+      a.mov(r3, bits);
+    } else {
+      a.bitOr(r3, bits);
+    }
+    a.rsh(r1, bits);
+    a.bind(lower);
+  }
+  a.rsh(r1, 1);
+  a.bitOr(r3, r1);
+  a.add(r2, r3);
+  a.store(Size::DW, r10, key + OFFSET(struct latency_key, slot), r2);
+
+  increment(a, latencyMap, key, zero, remove);
+  deleteInfotmp<Flags>(a, remove, out);
+  return a;
+}
+
+/**
+ * trace_exit, which sees the filename and the return value at once with
+ * --attach fexit, so nothing is passed through infotmp. Its context is the
+ * arguments followed by the return value, and the event is timestamped when
+ * the open returns rather than when it started. With PROGRAM_ENTRY_ONLY, it is
+ * attached where the open starts instead, and sends a ret of 0.
+ *
+ *   // PROGRAM_FAILED
+ *   if ((int)CTX_FIELD(retOffset) >= 0) return 0;
+ *   struct data_t *data = scratch.lookup(&zero);
+ *   if (data == 0) return 0;
+ *   data->id = bpf_get_current_pid_tgid();
+ *   data->ts = bpf_ktime_get_ns();
+ *   data->ret = CTX_FIELD(retOffset);
+ *   data->repeats = 0;
+ *   data->origin = origin;
+ *   bpf_get_current_comm(&data->comm, sizeof(data->comm));
+ *   int len = bpf_probe_read_str(&data->fname, fnameSize,
+ *                                CTX_FIELD(filenameOffset));
+ *   if (len < 1) len = 1;
+ *   len &= LONG_FNAME_MAX;
+ *   (submitRecord)
+ */
+template <unsigned Flags> constexpr Assembler traceExit() {
+  constexpr int16_t scratchKey = -4;
+  Assembler a;
+  Label out = a.newLabel();
+
+  a.mov(r6, r1);
+  if constexpr (Flags & PROGRAM_FAILED) {
+    a.load(Size::DW, r1, r6, retOffset);
+    a.lsh(r1, 32);
+    a.arsh(r1, 32);
+    a.jsgt(r1, -1, out);
+  }
+  a.mov(r1, 0);
+  a.store(Size::W, r10, scratchKey, r1);
+  a.loadMap(r1, scratchMap);
+  a.mov(r2, r10);
+  a.add(r2, scratchKey);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.mov(r7, r0);
+  a.jeq(r7, 0, out);
+
+  a.call(BPF_FUNC_get_current_pid_tgid);
+  a.store(Size::DW, r7, DATA(id), r0);
+  a.call(BPF_FUNC_ktime_get_ns);
+  a.store(Size::DW, r7, DATA(ts), r0);
+  if constexpr (Flags & PROGRAM_ENTRY_ONLY) {
+    a.mov(r1, 0);
+    a.store(Size::W, r7, DATA(ret), r1);
+  } else {
+    a.load(Size::DW, r1, r6, retOffset);
+    a.store(Size::W, r7, DATA(ret), r1);
+    a.mov(r1, 0);
+  }
+  a.store(Size::W, r7, DATA(repeats), r1);
+  a.mov(r1, origin);
+  a.store(Size::W, r7, DATA(origin), r1);
+  a.mov(r1, r7);
+  a.add(r1, DATA(comm));
+  a.mov(r2, TASK_COMM_LEN);
+  a.call(BPF_FUNC_get_current_comm);
+  a.load(Size::DW, r3, r6, filenameOffset);
+  readFilename(a);
+  a.bitAnd(r9, LONG_FNAME_MAX);
+  submitRecord<Flags>(a);
+
+  a.bind(out);
+  a.mov(r0, 0);
+  a.exit();
+  return a;
+}
+
+constexpr bool hasAny(unsigned flags, unsigned mask) {
+  return (flags & mask) != 0;
+}
+
+constexpr int countBits(unsigned flags) {
+  int count = 0;
+  for (; flags != 0; flags &= flags - 1) {
+    count++;
+  }
+  return count;
+}
+
+/**
+ * The programs, as their flags, the combinations of them that they have a
+ * variant for, and how to assemble one.
+ */
+struct TraceEntry {
+  static constexpr unsigned FLAGS = PROGRAM_TIDS | PROGRAM_PIDS |
+                                    PROGRAM_CGROUPS | PROGRAM_COMMS |
+                                    PROGRAM_SAMPLED | PROGRAM_TASK_STORAGE;
+  static constexpr int MAX_INSTRUCTIONS = MAX_NUM_TRACE_ENTRY_INSTRUCTIONS;
+
+  static constexpr bool has(unsigned flags) {
+    return countBits(flags & (PROGRAM_TIDS | PROGRAM_PIDS | PROGRAM_CGROUPS)) <=
+           1;
+  }
+
+  template <unsigned Flags> static constexpr Assembler assemble() {
+    return traceEntry<Flags>();
+  }
+};
+
+struct TraceReturn {
+  static constexpr unsigned FLAGS =
+      PROGRAM_TASK_STORAGE | PROGRAM_FAILED | PROGRAM_PREFIXES |
+      PROGRAM_DEDUP | PROGRAM_RINGBUF | PROGRAM_BATCHED | PROGRAM_AGGREGATE |
+      PROGRAM_LATENCY | PROGRAM_FILTERED;
+  static constexpr int MAX_INSTRUCTIONS = MAX_NUM_TRACE_RETURN_INSTRUCTIONS;
+
+  static constexpr bool has(unsigned flags) {
+    unsigned sending = PROGRAM_DEDUP | PROGRAM_RINGBUF | PROGRAM_BATCHED;
+    if (hasAny(flags, PROGRAM_BATCHED) && !hasAny(flags, PROGRAM_RINGBUF)) {
+      return false;
+    }
+    if (hasAny(flags, PROGRAM_AGGREGATE)) {
+      return !hasAny(flags, sending | PROGRAM_LATENCY);
+    }
+    if (hasAny(flags, PROGRAM_LATENCY)) {
+      return !hasAny(flags, sending | PROGRAM_PREFIXES);
+    }
+    return true;
+  }
+
+  template <unsigned Flags> static constexpr Assembler assemble() {
+    if constexpr (Flags & PROGRAM_AGGREGATE) {
+      return traceReturnAggregate<Flags>();
+    } else if constexpr (Flags & PROGRAM_LATENCY) {
+      return traceReturnLatency<Flags>();
+    } else {
+      return traceReturn<Flags>();
+    }
+  }
+};
+
+struct TraceExit {
+  static constexpr unsigned FLAGS =
+      PROGRAM_FAILED | PROGRAM_RINGBUF | PROGRAM_BATCHED | PROGRAM_ENTRY_ONLY;
+  static constexpr int MAX_INSTRUCTIONS = MAX_NUM_TRACE_EXIT_INSTRUCTIONS;
+
+  static constexpr bool has(unsigned flags) {
+    if (hasAny(flags, PROGRAM_BATCHED) && !hasAny(flags, PROGRAM_RINGBUF)) {
+      return false;
+    }
+    return !(hasAny(flags, PROGRAM_ENTRY_ONLY) &&
+             hasAny(flags, PROGRAM_FAILED));
+  }
+
+  template <unsigned Flags> static constexpr Assembler assemble() {
+    return traceExit<Flags>();
+  }
+};
+
+// A variant of one of the programs above, assembled once, at compile time.
+template <typename Kind, unsigned Flags> struct Variant {
+  static constexpr Assembler assembler = Kind::template assemble<Flags>();
+  static_assert(assembler.size() <= Kind::MAX_INSTRUCTIONS,
+                "MAX_NUM_*_INSTRUCTIONS in programs.h is too small");
+  static constexpr auto program =
+      assembler.template program<assembler.size(), assembler.numParams()>();
+};
+
+template <typename Kind, unsigned Flags>
+int linkVariant(const program_args &args, struct bpf_insn insns[]) {
+  if constexpr (Kind::has(Flags)) {
+    return Variant<Kind, Flags>::program.link(args, insns);
+  } else {
+    return -1;
+  }
+}
+
+// Spreads the bits of index over the bits that are set in mask, so that every
+// index below 1 << countBits(mask) maps to a different subset of mask.
+constexpr unsigned deposit(unsigned index, unsigned mask) {
+  unsigned flags = 0;
+  for (unsigned bit = 1; mask != 0; bit <<= 1) {
+    unsigned lowest = mask & -mask;
+    if (index & bit) {
+      flags |= lowest;
+    }
+    mask &= ~lowest;
+  }
+  return flags;
+}
+
+template <typename Kind, size_t... Indexes>
+int link(unsigned flags, const program_args &args, struct bpf_insn insns[],
+         std::index_sequence<Indexes...>) {
+  int numInstructions = -1;
+  // At most one of these matches flags.
+  (void)((flags == deposit(Indexes, Kind::FLAGS) &&
+          (numInstructions =
+               linkVariant<Kind, deposit(Indexes, Kind::FLAGS)>(args, insns),
+           true)) ||
+         ...);
+  return numInstructions;
+}
+
+// Links the variant of Kind for flags, or returns -1 if it has none.
+template <typename Kind>
+int link(unsigned flags, const program_args &args, struct bpf_insn insns[]) {
+  return link<Kind>(
+      flags, args, insns,
+      std::make_index_sequence<size_t{1} << countBits(Kind::FLAGS)>());
+}
+
+} // namespace
+
+int assembleProgram(enum program program, unsigned flags,
+                    const struct program_args *args, struct bpf_insn insns[]) {
+  int numInstructions = -1;
+  switch (program) {
+  case PROGRAM_TRACE_ENTRY:
+    numInstructions = link<TraceEntry>(flags, *args, insns);
+    break;
+  case PROGRAM_TRACE_RETURN:
+    numInstructions = link<TraceReturn>(flags, *args, insns);
+    break;
+  case PROGRAM_TRACE_EXIT:
+    numInstructions = link<TraceExit>(flags, *args, insns);
+    break;
+  }
+  if (numInstructions < 0) {
+    errno = EINVAL;
+  }
+  return numInstructions;
+}
@@ -0,0 +1,118 @@
+/**
+ * The BPF programs that opensnoop loads, which programs.cc assembles at compile
+ * time in every variant that the command line can ask for.
+ */
+#pragma once
+#include <linux/bpf.h>
+
+enum program {
+  // Attached where the open starts, to save what trace_return needs in
+  // infotmp.
+  PROGRAM_TRACE_ENTRY,
+  // Attached where the open returns, to send or count it.
+  PROGRAM_TRACE_RETURN,
+  // For --attach fexit, which sees the filename and the return value at once,
+  // and for --entry-only.
+  PROGRAM_TRACE_EXIT,
+};
+
+/**
+ * Which variant of a program to assemble: a bitwise OR of these. Each program
+ * only takes some of them, and only in some combinations.
+ */
+enum program_flag {
+  // trace_entry only traces the TIDs or the PIDs in pids (-t or -p), or the
+  // cgroups in cgroups (--cgroup). These cannot be combined.
+  PROGRAM_TIDS = 1 << 0,
+  PROGRAM_PIDS = 1 << 1,
+  PROGRAM_CGROUPS = 1 << 2,
+  // trace_entry only traces the comms in comms (--comm).
+  PROGRAM_COMMS = 1 << 3,
+  // trace_entry only traces 1 in sample opens (--sample).
+  PROGRAM_SAMPLED = 1 << 4,
+  // infotmp is task storage rather than a hash (--entry-state task), for
+  // trace_entry and trace_return.
+  PROGRAM_TASK_STORAGE = 1 << 5,
+  // trace_return and trace_exit only send failed opens (-x).
+  PROGRAM_FAILED = 1 << 6,
+  // trace_return only sends or counts opens of the filenames that start with
+  // one of prefixes (--prefix).
+  PROGRAM_PREFIXES = 1 << 7,
+  // trace_return only sends the first open of a filename by a process in
+  // every dedupWindow milliseconds (--dedup).
+  PROGRAM_DEDUP = 1 << 8,
+  // trace_return and trace_exit send events through a ring buffer rather than
+  // a perf buffer (--ringbuf)...
+  PROGRAM_RINGBUF = 1 << 9,
+  // ...and only wake the consumer up once watermark bytes are waiting.
+  PROGRAM_BATCHED = 1 << 10,
+  // trace_return counts opens in aggregates instead of sending them
+  // (--aggregate), which cannot be combined with the flags for sending them.
+  PROGRAM_AGGREGATE = 1 << 11,
+  // trace_return only updates the histogram in latency (--latency), which
+  // cannot be combined with the flags for sending opens or with --prefix.
+  PROGRAM_LATENCY = 1 << 12,
+  // trace_exit is attached where the open starts, so it has no return value
+  // (--entry-only), which cannot be combined with PROGRAM_FAILED.
+  PROGRAM_ENTRY_ONLY = 1 << 13,
+  // trace_return starts behind the part of --filter that compares ret, which
+  // leaves r9 set if the open is filtered out, so that trace_return can drop
+  // it and delete its infotmp entry (see filterCompile()).
+  PROGRAM_FILTERED = 1 << 14,
+};
+
+/**
+ * What the programs are linked with when they are loaded. A program only reads
+ * the members that its variant uses.
+ */
+struct program_args {
+  // Offsets into the context of the filename argument and the return value.
+  int filenameOffset;
+  int retOffset;
+  // Index of the attach point that events are tagged with.
+  int origin;
+  // How many bytes of the filename to read: NAME_MAX, or LONG_FNAME_MAX for
+  // --long-paths.
+  int fnameSize;
+  int sample;
+  // With PROGRAM_BATCHED, in bytes.
+  int watermark;
+  // With PROGRAM_DEDUP, in milliseconds.
+  int dedupWindow;
+  // The maps, where eventsMapFd is the ring buffer with PROGRAM_RINGBUF and
+  // the perf event array otherwise.
+  int infotmpMapFd;
+  int eventsMapFd;
+  int commsMapFd;
+  int aggregatesMapFd;
+  int latencyMapFd;
+  int updateFailuresMapFd;
+  int scratchMapFd;
+  int pidsMapFd;
+  int cgroupsMapFd;
+  int prefixesMapFd;
+  int dedupMapFd;
+};
+
+// The most instructions that any variant of each program has, for sizing the
+// arrays that assembleProgram() fills in.
+#define MAX_NUM_TRACE_ENTRY_INSTRUCTIONS 86
+#define MAX_NUM_TRACE_RETURN_INSTRUCTIONS 136
+#define MAX_NUM_TRACE_EXIT_INSTRUCTIONS 52
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Fills in insns with the variant of program that flags ask for, linked with
+ * args, and returns its number of instructions. Returns -1 with errno set to
+ * EINVAL if program has no such variant, or if an offset in args does not fit
+ * in an instruction.
+ */
+int assembleProgram(enum program program, unsigned flags,
+                    const struct program_args *args, struct bpf_insn insns[]);
+
+#ifdef __cplusplus
+}
+#endif